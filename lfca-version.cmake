@@ -0,0 +1,29 @@
+# Writes the commit that the benchmark is built from, and whether the work tree has uncommitted changes, to a header.
+# Run by the lfca_version target on every build, so that the benchmark results never report a stale commit.
+# Usage: cmake -DSOURCE_DIR=<repository> -DOUTPUT=<header> -P lfca-version.cmake
+execute_process(COMMAND git rev-parse --short HEAD
+    OUTPUT_VARIABLE LFCA_COMMIT
+    OUTPUT_STRIP_TRAILING_WHITESPACE
+    RESULT_VARIABLE result
+    ERROR_QUIET
+    WORKING_DIRECTORY ${SOURCE_DIR})
+if(result OR NOT LFCA_COMMIT)
+    set(LFCA_COMMIT "unknown")
+    set(LFCA_DIRTY "unknown")
+else()
+    # Untracked files are not part of the build, so they do not count
+    execute_process(COMMAND git status --porcelain --untracked-files=no
+        OUTPUT_VARIABLE changes
+        ERROR_QUIET
+        WORKING_DIRECTORY ${SOURCE_DIR})
+    if(changes)
+        set(LFCA_DIRTY "yes")
+    else()
+        set(LFCA_DIRTY "no")
+    endif()
+endif()
+
+# Only replace the header when it changes, so that main.cpp is not rebuilt every time
+file(WRITE ${OUTPUT}.tmp "// Generated by lfca-version.cmake\n#define LFCA_COMMIT \"${LFCA_COMMIT}\"\n#define LFCA_DIRTY \"${LFCA_DIRTY}\"\n")
+execute_process(COMMAND ${CMAKE_COMMAND} -E copy_if_different ${OUTPUT}.tmp ${OUTPUT})
+file(REMOVE ${OUTPUT}.tmp)
@@ -5,7 +5,7 @@
  *
  * Major modifications:
  * The node structs are combined into a single struct
- * C utilities used in the original implementation, such as stack, now use C++ standard library variants
+ * C utilities used in the original implementation now use C++ standard library variants, except for the range query traversal stack, which is a reusable thread-local buffer
  * Range query results are stored in vectors instead of treaps
  * Our custom immutable treaps are used in place of the original
  * High contention adaptations (splits) are forced when a treap has reached the maximum size due to our fixed-size treaps
@@ -14,23 +14,320 @@
 
 #include "lfca.h"
 
-#include <stack>
+#include <algorithm>
+#include <climits>
+#include <memory>
+#include <thread>
 
 using namespace std;
 
+#define TRAVERSAL_STACK_SLACK 64  // Popped entries kept by a traversal stack before it is compacted
+
+#if defined(__GNUC__)
+#define PREFETCH(p) __builtin_prefetch(p)
+#else
+#define PREFETCH(p)
+#endif
+
+/**
+ * The stack used by range queries to walk base nodes in order.
+ *
+ * Popped entries are left in place and each entry links to the entry below it, so the stack can be saved and restored in constant time.
+ * The entries are kept in buffers that are reused between range queries, so walking the tree does not allocate once the buffers are large enough.
+ */
+class TraversalStack {
+private:
+    struct Entry {
+        node *n;
+        int below;  // Index of the entry below this one, or -1
+    };
+
+    vector<Entry> entries;
+    vector<Entry> compacted;  // Spare buffer used while compacting
+    int topIndex{-1};
+    int depth{0};
+
+    // Moves the entries that are still on the stack to the start of the buffer
+    void compact() {
+        compacted.resize(depth);
+
+        int index = topIndex;
+        for (int i = depth - 1; i >= 0; i--) {
+            compacted[i].n = entries[index].n;
+            compacted[i].below = i - 1;
+            index = entries[index].below;
+        }
+
+        entries.swap(compacted);
+        topIndex = depth - 1;
+    }
+
+public:
+    struct Checkpoint {
+        int topIndex;
+        int depth;
+        size_t size;
+    };
+
+    void clear() {
+        entries.clear();
+        topIndex = -1;
+        depth = 0;
+    }
+
+    void push(node *n) {
+        entries.push_back(Entry{n, topIndex});
+        topIndex = entries.size() - 1;
+        depth++;
+    }
+
+    void pop() {
+        topIndex = entries[topIndex].below;
+        depth--;
+    }
+
+    node *top() {
+        return entries[topIndex].n;
+    }
+
+    bool empty() {
+        return depth == 0;
+    }
+
+    // Saves the current stack. Only the latest checkpoint can be restored.
+    Checkpoint checkpoint() {
+        if (entries.size() > 2 * (size_t)depth + TRAVERSAL_STACK_SLACK) {
+            compact();
+        }
+
+        return Checkpoint{topIndex, depth, entries.size()};
+    }
+
+    void restore(const Checkpoint &c) {
+        topIndex = c.topIndex;
+        depth = c.depth;
+        entries.resize(c.size);
+    }
+};
+
+/**
+ * Buffers used by a single range query. Range queries can help other range queries, so each nesting level on a thread has its own buffers.
+ */
+struct RangeQueryBuffers {
+    TraversalStack s;
+    vector<node *> done;
+};
+
+class RangeQueryBuffersLease {
+private:
+    static thread_local vector<unique_ptr<RangeQueryBuffers>> pool;
+    static thread_local size_t inUse;
+
+public:
+    RangeQueryBuffers *buffers;
+
+    RangeQueryBuffersLease() {
+        if (inUse == pool.size()) {
+            pool.push_back(unique_ptr<RangeQueryBuffers>(new RangeQueryBuffers()));
+        }
+
+        buffers = pool[inUse++].get();
+        buffers->s.clear();
+        buffers->done.clear();
+    }
+
+    ~RangeQueryBuffersLease() {
+        inUse--;
+    }
+};
+
+thread_local vector<unique_ptr<RangeQueryBuffers>> RangeQueryBuffersLease::pool;
+thread_local size_t RangeQueryBuffersLease::inUse = 0;
+
+// Slot versions, used for snapshots. This follows the versioned CAS objects of Wei et al., "Constant-time snapshots with applications to concurrent data structures".
+// Every change to a child slot records the node it replaced, and is stamped with the clock some time after the change and before anyone reads past the new node.
+// A snapshot advances the clock, and reads each slot as the latest version stamped no later than the snapshot.
+
+static atomic<long long> versionClock{1};  // Time 0 is used for nodes that are installed together with their route node
+
+static long long take_snapshot() {
+    long long ts = versionClock.load();
+    versionClock.compare_exchange_strong(ts, ts + 1);
+    return ts;
+}
+
+// Prepares a node to be installed into a slot of owner, replacing prev. The node is published by the CAS that installs it, so a relaxed store is enough.
+static void init_version(node *n, node *owner, node *prev, long long ts = TS_UNSET) {
+    n->version.owner = owner;
+    n->version.prev = prev;
+    n->version.ts.store(ts, memory_order_relaxed);
+}
+
+// Creates a base node of another type with the items of b. Preallocated nodes start out with the initial value of every field,
+// so only the fields shared by all base nodes are copied. The caller sets the fields of the new type before publishing the node with a CAS.
+static node *clone_base(node *b, node_type type) {
+    node *n = node::New();
+    n->type = type;
+    n->data = b->data;
+    n->stat = b->stat;
+    n->parent = b->parent;
+
+    return n;
+}
+
+static slot_version *version_of(node *n, node *owner) {
+    if (n->version.owner == owner) {
+        return &n->version;
+    }
+
+    for (slot_version *v = n->moved.load(); v != nullptr; v = v->next.load()) {
+        if (v->owner == owner) {
+            return v;
+        }
+    }
+
+    return nullptr;
+}
+
+static void init_ts(atomic<long long> &ts) {
+    if (ts.load() == TS_UNSET) {
+        long long expected = TS_UNSET;
+        ts.compare_exchange_strong(expected, versionClock.load());
+    }
+}
+
+// Stamps the version of the slot of owner that holds n.
+// A timestamp never changes once it is set, and the slot load that found n synchronizes with the join that added a moved version, so the fast path only needs acquire loads.
+static inline void stamp(node *n, node *owner) {
+    if (n->version.ts.load(memory_order_acquire) != TS_UNSET && n->moved.load(memory_order_acquire) == nullptr) {
+        return;
+    }
+
+    slot_version *v = version_of(n, owner);
+    if (v != nullptr) {
+        init_ts(v->ts);
+    }
+}
+
+// Reads a child slot. Every traversal reads slots through this, so that no change below an unstamped slot is seen before the slot is stamped.
+static inline node *read_child(node *owner, atomic<node *> &slot) {
+    node *n = slot.load(memory_order_acquire);
+    stamp(n, owner);
+    return n;
+}
+
+// Slot changes stay seq_cst. A snapshot increments the clock and then reads slots, while an update changes a slot and then reads the clock to stamp it.
+// Only seq_cst makes a snapshot see every change that is stamped with an earlier time.
+static bool versioned_cas(node *owner, atomic<node *> &slot, node *expected, node *n) {
+    // The replaced version must be stamped before the new one
+    stamp(expected, owner);
+
+    if (slot.compare_exchange_strong(expected, n)) {
+        stamp(n, owner);
+        return true;
+    }
+
+    return false;
+}
+
+// Adds a version to a node that is about to be moved into another slot. Everyone helping the move adds the same version, so it is only added once.
+static void add_version(node *n, slot_version *v) {
+    slot_version *head = n->moved.load();
+
+    while (true) {
+        for (slot_version *existing = head; existing != nullptr; existing = existing->next.load()) {
+            if (existing == v) {
+                return;
+            }
+        }
+
+        v->next.store(head);
+        if (n->moved.compare_exchange_strong(head, v)) {
+            return;
+        }
+    }
+}
+
+// Returns the node a slot of owner held at time ts, given the node it holds now
+static node *read_version(node *owner, node *n, long long ts) {
+    while (true) {
+        slot_version *v = version_of(n, owner);
+        init_ts(v->ts);
+
+        if (v->ts.load() <= ts) {
+            return n;
+        }
+
+        n = v->prev;
+    }
+}
+
+// Items a frozen base node holds once its multi-key operation is decided
+static Treap *decided_data(multi_result *res, node *n) {
+    for (int i = 0; i < res->count; i++) {
+        if (res->frozen[i] == n) {
+            return res->data[i];
+        }
+    }
+
+    // Frozen by a helper after the outcome was decided
+    return n->data;
+}
+
+// Items of a base node. The decided items of a multi-key operation count as soon as the operation is decided, before they are installed.
+static Treap *current_data(node *n) {
+    if (n->type == multi) {
+        multi_result *res = n->multi_storage->result.load(memory_order_acquire);
+        if (res != nullptr) {
+            init_ts(res->ts);
+            return decided_data(res, n);
+        }
+    }
+
+    return n->data;
+}
+
 // Forward declare helper functions as needed
-node *find_base_stack(node *n, int i, stack<node *> *s);
+node *find_base_stack(node *n, int i, TraversalStack *s);
 node *find_base_node(node *n, int i);
-node *leftmost_and_stack(node *n, stack<node *> *s);
+node *find_base_node(node *n, int i, node **gparent);
+node *find_base_node(node *n, int i, node **gparent, long long *hi);
+node *leftmost_and_stack(node *n, TraversalStack *s);
 
-// Helper functions for do_update
+// Helper functions for do_update. These return the same treap if nothing changes, and NULL if the treap is too full for the update.
 Treap *treap_insert(Treap *treap, int val, bool *result) {
+    // Sets keep a single copy of each value
+    if (treap->contains(val)) {
+        *result = false;
+        return treap;
+    }
+
+    if (treap->getSize() >= TREAP_NODES) {
+        return nullptr;
+    }
+
+    Treap *newTreap = treap->immutableInsert(val);
+    *result = true;
+    return newTreap;
+}
+
+Treap *treap_insert_multiset(Treap *treap, int val, bool *result) {
+    if (treap->getSize() >= TREAP_NODES) {
+        return nullptr;
+    }
+
     Treap *newTreap = treap->immutableInsert(val);
     *result = true;  // Inserts always succeed
     return newTreap;
 }
 
 Treap *treap_remove(Treap *treap, int val, bool *result) {
+    // Removing an absent value changes nothing, so skip the copy
+    if (!treap->contains(val)) {
+        *result = false;
+        return treap;
+    }
+
     Treap *newTreap = treap->immutableRemove(val, result);
     return newTreap;
 }
@@ -38,7 +335,7 @@ Treap *treap_remove(Treap *treap, int val, bool *result) {
 // Undefined functions that need implementations:
 
 // This function is undefined in the pdf, assume replaces head of stack with n?
-void replace_top(stack<node *> *s, node *n) {
+void replace_top(TraversalStack *s, node *n) {
     s->pop();
     s->push(n);
     return;
@@ -48,7 +345,7 @@ void replace_top(stack<node *> *s, node *n) {
 node *leftmost(node *n) {
     node *temp = n;
     while (temp->left != nullptr)
-        temp = temp->left;
+        temp = read_child(temp, temp->left);
     return temp;
 }
 
@@ -56,22 +353,20 @@ node *leftmost(node *n) {
 node *rightmost(node *n) {
     node *temp = n;
     while (temp->right != nullptr)
-        temp = temp->right;
+        temp = read_child(temp, temp->right);
     return temp;
 }
 
 // Help functions
 bool LfcaTree::try_replace(node *b, node *new_b) {
-    node *expectedB = b;
-
     if (b->parent == nullptr) {
-        return root.compare_exchange_strong(expectedB, new_b);
+        return versioned_cas(nullptr, root, b, new_b);
     }
     else if (b->parent->left.load() == b) {
-        return b->parent->left.compare_exchange_strong(expectedB, new_b);
+        return versioned_cas(b->parent, b->parent->left, b, new_b);
     }
     else if (b->parent->right.load() == b) {
-        return b->parent->right.compare_exchange_strong(expectedB, new_b);
+        return versioned_cas(b->parent, b->parent->right, b, new_b);
     }
 
     return false;
@@ -91,7 +386,7 @@ bool is_replaceable(node *n) {
         }
 
         case range:
-            return n->storage->result.load() != NOT_SET;
+            return n->storage->result.load(memory_order_acquire) != NOT_SET;
 
         default:
             return false;
@@ -106,19 +401,25 @@ void LfcaTree::help_if_needed(node *n) {
 
     if (n->type == join_main && n->neigh2.load() == PREPARING) {
         node *expectedNeigh2 = PREPARING;
-        n->neigh2.compare_exchange_strong(expectedNeigh2, ABORTED);
+        if (n->neigh2.compare_exchange_strong(expectedNeigh2, ABORTED)) {
+            trace(trace_abort, n->data, n->parent->key, n->stat);
+        }
     }
     else if (n->type == join_main && n->neigh2.load() > ABORTED) {
         complete_join(n);
     }
-    else if (n->type == range && n->storage->result.load() == NOT_SET) {
+    else if (n->type == range && n->storage->result.load(memory_order_acquire) == NOT_SET) {
         all_in_range(n->lo, n->hi, n->storage);
     }
+    else if (n->type == multi) {
+        multi_update(n->multi_storage);
+        release_multi(n);
+    }
 }
 
 int new_stat(node *n, contention_info info) {
     int range_sub = 0;
-    if (n->type == range && n->storage->more_than_one_base.load()) {
+    if (n->type == range && n->storage->more_than_one_base.load(memory_order_relaxed)) {  // Only a hint for the statistics
         range_sub = RANGE_CONTRIB;
     }
 
@@ -133,7 +434,7 @@ int new_stat(node *n, contention_info info) {
     return n->stat;
 }
 
-void LfcaTree::adapt_if_needed(node *b) {
+void LfcaTree::adapt_if_needed(node *b, node *gparent_hint) {
     if (!is_replaceable(b)) {
         return;
     }
@@ -141,70 +442,596 @@ void LfcaTree::adapt_if_needed(node *b) {
         high_contention_adaptation(b);
     }
     else if (new_stat(b, noinfo) < LOW_CONT) {
-        low_contention_adaptation(b);
+        low_contention_adaptation(b, gparent_hint);
     }
 }
 
-bool LfcaTree::do_update(Treap *(*u)(Treap *, int, bool *), int i) {
+bool LfcaTree::do_update(Treap *(*u)(Treap *, int, bool *), int i, update_type type) {
     contention_info cont_info = uncontened;
+    bool publish = false;  // Publish the update for flat combining instead of replacing the base node
 
     while (true) {
-        node *base = find_base_node(root.load(), i);
+        node *gparent;  // Parent of the base node's parent, kept for joins
+        node *base = find_base_node(read_root(), i, &gparent);
+
+        // Replacing a base node that is being combined would make the combiner retry, so join its publication list instead
+        fc *pending = base->pending.load(memory_order_relaxed);
+        if (!publish && pending != nullptr && pending != FC_CLOSED) {
+            publish = combining.load(memory_order_relaxed);
+        }
+
+        if (publish && is_replaceable(base)) {
+            fc op;
+            op.u = u;
+            op.key = i;
+
+            fc_state state = combine(base, &op, gparent);
+            if (state == fc_done) {
+                return op.result;
+            }
 
-        // If the treap is full, try to split the node and retry the insert
-        if (base->data->getSize() >= TREAP_NODES) {
-            high_contention_adaptation(base);
+            // Retry by replacing the base node, which also splits a full treap. If that fails as well, the update is published again.
+            publish = false;
             continue;
         }
 
         if (is_replaceable(base)) {
             bool res;
+            Treap *newData = u(base->data, i, &res);
+
+            // Nothing changes, so reading the base node was enough. This is linearized like a lookup.
+            if (newData == base->data) {
+                return res;
+            }
+
+            // If the treap is full, try to split the node and retry the update
+            if (newData == nullptr) {
+                make_room(base, i);
+                continue;
+            }
 
             node *newb = node::New();
             newb->type = normal;
             newb->parent = base->parent;
-            newb->data = u(base->data, i, &res);
+            newb->data = newData;
             newb->stat = new_stat(base, cont_info);
+            init_version(newb, base->parent, base);
 
             if (try_replace(base, newb)) {
-                adapt_if_needed(newb);
+                adapt_if_needed(newb, gparent);
                 return res;
             }
         }
 
         cont_info = contended;
+        publish = combining.load(memory_order_relaxed);
+
+        if (base->stat >= ELIMINATION_CONT && elimination.load(memory_order_relaxed) && try_eliminate(i, type)) {
+            trace(trace_eliminate, base->data, i, base->stat);
+            return true;
+        }
+
         help_if_needed(base);
     }
 }
 
+// Elimination. An insert and a remove of the same value that meet in the elimination array both succeed without changing the tree.
+// A slot holds the value, the type and the state of an offer, and a sequence number that is increased for every offer, so that an offer is never mistaken for an older one.
+// For sets, the pair is linearized when the matching thread reads the value as absent, and the offering thread is waiting at that time.
+#define ELIM_EMPTY 0
+#define ELIM_WAITING 1
+#define ELIM_MATCHED 2
+
+static inline unsigned long long elim_pack(int i, update_type type, unsigned long long seq, int state) {
+    return ((unsigned long long)(unsigned int)i << 32) | ((seq & 0x1FFFFFFF) << 3) | ((unsigned long long)type << 2) | state;
+}
+
+static inline int elim_value(unsigned long long slot) {
+    return (int)(unsigned int)(slot >> 32);
+}
+
+static inline unsigned long long elim_seq(unsigned long long slot) {
+    return (slot >> 3) & 0x1FFFFFFF;
+}
+
+static inline update_type elim_type(unsigned long long slot) {
+    return (update_type)((slot >> 2) & 1);
+}
+
+static inline int elim_state(unsigned long long slot) {
+    return slot & 3;
+}
+
+bool LfcaTree::try_eliminate(int i, update_type type) {
+    atomic<unsigned long long> &slot = eliminationSlots[(unsigned int)i % ELIMINATION_SLOTS];
+    unsigned long long current = slot.load();
+
+    // Match a waiting offer of the opposite update
+    if (elim_state(current) == ELIM_WAITING) {
+        if (elim_value(current) != i || elim_type(current) == type) {
+            return false;
+        }
+
+        // In a set, inserting and then removing the value only cancels out if the value is absent
+        if (!multiset && lookup(i)) {
+            return false;
+        }
+
+        return slot.compare_exchange_strong(current, elim_pack(i, elim_type(current), elim_seq(current), ELIM_MATCHED));
+    }
+    else if (elim_state(current) != ELIM_EMPTY) {
+        return false;
+    }
+
+    // Offer this update and wait for a match
+    unsigned long long offer = elim_pack(i, type, elim_seq(current) + 1, ELIM_WAITING);
+    if (!slot.compare_exchange_strong(current, offer)) {
+        return false;
+    }
+
+    for (int spin = 0; spin < ELIMINATION_SPINS && slot.load(memory_order_relaxed) == offer; spin++) {
+    }
+
+    unsigned long long empty = elim_pack(0, update_insert, elim_seq(offer), ELIM_EMPTY);
+    if (slot.compare_exchange_strong(offer, empty)) {
+        return false;  // Withdrawn without a match
+    }
+
+    // Matched. Only this thread changes a matched offer
+    slot.store(empty);
+    return true;
+}
+
+// Flat combining. The first thread to publish to a base node is the combiner. It closes the publication list, and applies every update in it.
+// The combined updates are linearized when the combiner replaces the base node, in list order.
+fc_state LfcaTree::combine(node *b, fc *op, node *gparent) {
+    fc *head = b->pending.load(memory_order_relaxed);
+    do {
+        // The list is already being combined, and the base node is about to be replaced
+        if (head == FC_CLOSED) {
+            return fc_retry;
+        }
+
+        op->next = head;
+    } while (!b->pending.compare_exchange_weak(head, op, memory_order_release, memory_order_relaxed));
+
+    if (head != nullptr) {
+        // The thread that published first combines the list holding op
+        while (op->state.load(memory_order_acquire) == fc_pending) {
+            this_thread::yield();
+        }
+
+        return op->state.load(memory_order_relaxed);
+    }
+
+    // Give other threads a chance to publish before closing the list
+    for (int spin = 0; spin < COMBINING_SPINS && b->pending.load(memory_order_relaxed) == op; spin++) {
+    }
+
+    // Threads that would publish may be descheduled, which spinning does not help with
+    if (b->pending.load(memory_order_relaxed) == op) {
+        this_thread::yield();
+    }
+
+    fc *ops = b->pending.exchange(FC_CLOSED, memory_order_acquire);
+
+    // Combining several updates takes the place of a split
+    apply_updates(b, ops, gparent, ops->next != nullptr ? uncontened : contended);
+
+    return op->state.load(memory_order_relaxed);
+}
+
+// Applies a list of updates to a base node with a single replace, and stores the outcome in the state of each update
+void LfcaTree::apply_updates(node *b, fc *ops, node *gparent, contention_info info) {
+    // Apply the updates until one of them does not fit in the treap
+    Treap *data = b->data;
+    fc *full = ops;  // The first update that does not fit, if any
+    int applied = 0;
+    while (full != nullptr) {
+        Treap *newData = full->u(data, full->key, &full->result);
+        if (newData == nullptr) {
+            break;
+        }
+
+        data = newData;
+        full = full->next;
+        applied++;
+    }
+
+    bool replaced = false;
+    node *newb = nullptr;
+    if (applied > 0 && data == b->data) {
+        // Nothing changes, so reading the base node was enough. This is linearized like a lookup.
+        replaced = true;
+    }
+    else if (applied > 0) {
+        newb = node::New();
+        newb->type = normal;
+        newb->parent = b->parent;
+        newb->data = data;
+        newb->stat = new_stat(b, info);
+        init_version(newb, b->parent, b);
+
+        replaced = try_replace(b, newb);
+    }
+
+    if (replaced && applied > 1) {
+        trace(trace_combine, data, ops->key, b->stat);
+    }
+
+    // Report the outcome. Publishers return as soon as they see it, so their updates are not read after that.
+    bool isApplied = true;
+    for (fc *o = ops; o != nullptr;) {
+        fc *next = o->next;
+        isApplied = isApplied && o != full;
+        o->state.store(isApplied && replaced ? fc_done : fc_retry, memory_order_release);
+
+        o = next;
+    }
+
+    if (newb != nullptr && replaced) {
+        adapt_if_needed(newb, gparent);
+    }
+}
+
+void LfcaTree::updateBatch(const vector<batch_update> &ops, vector<bool> *results) {
+    vector<fc> records(ops.size());
+    vector<fc *> sorted;
+    sorted.reserve(ops.size());
+
+    for (size_t i = 0; i < ops.size(); i++) {
+        records[i].u = ops[i].type == update_insert ? (multiset ? treap_insert_multiset : treap_insert) : treap_remove;
+        records[i].key = ops[i].key;
+        sorted.push_back(&records[i]);
+    }
+
+    // Updates of the same value keep their order in the batch
+    stable_sort(sorted.begin(), sorted.end(), [](const fc *a, const fc *b) { return a->key < b->key; });
+
+    // Replace each base node once for all updates that fall into it
+    size_t next = 0;
+    while (next < sorted.size()) {
+        node *gparent;
+        long long hi;
+        node *base = find_base_node(read_root(), sorted[next]->key, &gparent, &hi);
+
+        size_t end = next + 1;
+        while (end < sorted.size() && sorted[end]->key <= hi) {
+            sorted[end - 1]->next = sorted[end];
+            end++;
+        }
+        sorted[end - 1]->next = nullptr;
+
+        if (is_replaceable(base)) {
+            apply_updates(base, sorted[next], gparent, uncontened);
+        }
+
+        // Updates that could not be applied together are applied on their own, which also helps and splits base nodes
+        for (size_t i = next; i < end; i++) {
+            fc *o = sorted[i];
+            if (o->state.load(memory_order_relaxed) != fc_done) {
+                o->result = do_update(o->u, o->key, ops[o - &records[0]].type);
+            }
+        }
+
+        next = end;
+    }
+
+    results->clear();
+    for (size_t i = 0; i < records.size(); i++) {
+        results->push_back(records[i].result);
+    }
+}
+
+// Tracing
+void LfcaTree::trace(trace_event_type type, Treap *data, int key, int stat) {
+    if (!tracing.load(memory_order_relaxed)) {
+        return;
+    }
+
+    TraceEvent event;
+    event.type = type;
+    event.treeId = traceId;
+    event.key = key;
+    event.stat = stat;
+    event.size = data->getSize();
+    event.lo = event.size > 0 ? data->getMinValue() : key;
+    event.hi = event.size > 0 ? data->getMaxValue() : key;
+
+    LfcaTrace::record(event);
+}
+
+void LfcaTree::setElimination(bool enabled) {
+    elimination.store(enabled);
+}
+
+void LfcaTree::setCombining(bool enabled) {
+    combining.store(enabled);
+}
+
+void LfcaTree::setTracing(bool enabled) {
+    if (enabled) {
+        LfcaTrace::registerThread();
+    }
+    tracing.store(enabled);
+}
+
+void LfcaTree::dumpTrace(ostream &out) {
+    LfcaTrace::dumpChromeJson(traceId, out);
+}
+
+// Introspection. These walk the tree without synchronization, so they must only be used while no other thread is using the tree.
+LfcaTreeDescription LfcaTree::describe() {
+    LfcaTreeDescription description;
+    description.sizeHistogram.assign(TREAP_NODES + 1, 0);
+
+    // Iterative depth-first walk, with the number of route nodes above each node
+    vector<pair<node *, int>> nodesToCheck;
+    nodesToCheck.push_back(make_pair(root.load(), 0));
+
+    while (!nodesToCheck.empty()) {
+        node *n = nodesToCheck.back().first;
+        int depth = nodesToCheck.back().second;
+        nodesToCheck.pop_back();
+
+        if (n->type == route) {
+            description.routeNodes++;
+            nodesToCheck.push_back(make_pair(n->left.load(), depth + 1));
+            nodesToCheck.push_back(make_pair(n->right.load(), depth + 1));
+            continue;
+        }
+
+        description.baseNodes++;
+        description.height = max(description.height, depth);
+        description.sizeHistogram.at(n->data->getSize())++;
+        description.statHistogram[n->stat]++;
+    }
+
+    return description;
+}
+
+void LfcaTree::dumpGraphviz(ostream &out) {
+    static const char *typeNames[] = {"route", "normal", "join_main", "join_neighbor", "range", "multi"};
+
+    out << "digraph lfca {" << endl;
+    out << "    node [fontname=\"monospace\"];" << endl;
+
+    vector<node *> nodesToCheck;
+    nodesToCheck.push_back(root.load());
+
+    while (!nodesToCheck.empty()) {
+        node *n = nodesToCheck.back();
+        nodesToCheck.pop_back();
+
+        if (n->type == route) {
+            out << "    n" << n << " [shape=ellipse, label=\"" << n->key << "\"];" << endl;
+            out << "    n" << n << " -> n" << n->left.load() << " [label=\"<=\"];" << endl;
+            out << "    n" << n << " -> n" << n->right.load() << " [label=\">\"];" << endl;
+
+            nodesToCheck.push_back(n->right.load());
+            nodesToCheck.push_back(n->left.load());
+            continue;
+        }
+
+        out << "    n" << n << " [shape=box, label=\"" << typeNames[n->type] << "\\nsize " << n->data->getSize() << "\\nstat " << n->stat << "\"];" << endl;
+    }
+
+    out << "}" << endl;
+}
+
 // Public interface
-LfcaTree::LfcaTree() {
+LfcaTree::LfcaTree(bool mvccRangeQueries, bool multiset) : mvccRangeQueries(mvccRangeQueries), multiset(multiset) {
+    traceId = LfcaTrace::newTreeId();
+
+    for (int i = 0; i < ELIMINATION_SLOTS; i++) {
+        eliminationSlots[i].store(elim_pack(0, update_insert, 0, ELIM_EMPTY));
+    }
+
     // Create root node
     node *rootNode = node::New();
     rootNode->type = normal;
     rootNode->data =  Treap::New();
+    init_version(rootNode, nullptr, nullptr, 0);
     root.store(rootNode);
 }
 
-void LfcaTree::insert(int i) {
-    do_update(treap_insert, i);
+bool LfcaTree::insert(int i) {
+    return do_update(multiset ? treap_insert_multiset : treap_insert, i, update_insert);
 }
 
 bool LfcaTree::remove(int i) {
-    return do_update(treap_remove, i);
+    return do_update(treap_remove, i, update_remove);
 }
 
 bool LfcaTree::lookup(int i) {
-    node *base = find_base_node(root.load(), i);
-    return base->data->contains(i);
+    node *base = find_base_node(read_root(), i);
+    return current_data(base)->contains(i);
+}
+
+// Prefetches the cache line of a node that a traversal reads. Every field read on a hop is in it
+static inline void prefetch_node(node *n) {
+    PREFETCH(n);
+}
+
+void LfcaTree::lookupBatch(const int *keys, bool *out, size_t n) {
+    // A lookup that has loaded a node pointer waits for its turn to read the node, while the other lookups in the group load theirs.
+    // The steps of each lookup are the same as those of lookup.
+    struct Lookup {
+        size_t index;
+        node *owner;  // Owner of the slot n was read from, or NULL (root)
+        node *n;      // Loaded, but not yet read
+        Treap *data;  // Items of the base node, once it is reached
+    };
+
+    Lookup group[LOOKUP_GROUP];
+    size_t active = 0;
+    size_t next = 0;
+
+    for (; active < LOOKUP_GROUP && next < n; active++, next++) {
+        group[active] = {next, nullptr, root.load(memory_order_acquire), nullptr};
+        prefetch_node(group[active].n);
+    }
+
+    while (active > 0) {
+        for (size_t g = 0; g < active;) {
+            Lookup &l = group[g];
+
+            if (l.data != nullptr) {
+                out[l.index] = l.data->contains(keys[l.index]);
+
+                // Start the next lookup in its place, or fill the place with the last lookup of the group
+                if (next < n) {
+                    l = {next++, nullptr, root.load(memory_order_acquire), nullptr};
+                    prefetch_node(l.n);
+                    g++;
+                }
+                else {
+                    l = group[--active];
+                }
+
+                continue;
+            }
+
+            stamp(l.n, l.owner);
+
+            if (l.n->type == route) {
+                l.owner = l.n;
+                l.n = keys[l.index] <= l.owner->key ? l.owner->left.load(memory_order_acquire) : l.owner->right.load(memory_order_acquire);
+                prefetch_node(l.n);
+            }
+            else {
+                l.data = current_data(l.n);
+                l.data->prefetchRoot();
+            }
+
+            g++;
+        }
+    }
 }
 
 vector<int> LfcaTree::rangeQuery(int lo, int hi) {
+    if (mvccRangeQueries) {
+        vector<int> res;
+        snapshot(lo, hi).appendRemaining(&res);
+        return res;
+    }
+
     return all_in_range(lo, hi, nullptr);
 }
 
+bool LfcaTree::insertIfAbsent(int val, int absent) {
+    return do_multi_update(multi_insert_if_absent, val, absent);
+}
+
+bool LfcaTree::move(int from, int to) {
+    return do_multi_update(multi_move, from, to);
+}
+
+bool LfcaTree::compareAndSwap(int expected, int desired) {
+    return do_multi_update(multi_compare_and_swap, expected, desired);
+}
+
+LfcaSnapshot LfcaTree::snapshot() {
+    return snapshot(numeric_limits<int>::min(), numeric_limits<int>::max());
+}
+
+LfcaSnapshot LfcaTree::snapshot(int low, int high) {
+    long long ts = take_snapshot();
+
+    // Slots read by snapshots stay seq_cst, see versioned_cas
+    return LfcaSnapshot(read_version(nullptr, root.load(), ts), ts, low, high);
+}
+
+node *LfcaTree::read_root() {
+    node *n = root.load(memory_order_acquire);
+    stamp(n, nullptr);
+    return n;
+}
+
+// Snapshot iterator
+LfcaSnapshot::LfcaSnapshot(node *root, long long ts, int low, int high) : ts(ts), low(low), high(high) {
+    nodesToVisit.push_back(Frame{root, (long long)numeric_limits<int>::min() - 1, numeric_limits<int>::max()});
+}
+
+bool LfcaSnapshot::next_base(Frame *f) {
+    while (!nodesToVisit.empty()) {
+        *f = nodesToVisit.back();
+        nodesToVisit.pop_back();
+
+        if (f->n->type != route) {
+            return true;
+        }
+
+        // Visit the left subtree first. Skip subtrees that are outside of the snapshot's range.
+        node *n = f->n;
+        if (n->key < high) {
+            nodesToVisit.push_back(Frame{read_version(n, n->right.load(), ts), n->key, f->hi});
+        }
+        if (n->key >= low) {
+            nodesToVisit.push_back(Frame{read_version(n, n->left.load(), ts), f->lo, n->key});
+        }
+    }
+
+    return false;
+}
+
+void LfcaSnapshot::base_values(const Frame &f, vector<int> *res) {
+    Treap *data = f.n->data;
+    if (f.n->type == multi) {
+        multi_result *decided = f.n->multi_storage->result.load();  // seq_cst, like the slots read by snapshots
+        if (decided != nullptr) {
+            init_ts(decided->ts);
+            if (decided->ts.load() <= ts) {
+                data = decided_data(decided, f.n);
+            }
+        }
+    }
+
+    // Base nodes that are being joined can hold values outside of their slot, so only take the values that belong here
+    data->rangeQuery((int)max(f.lo + 1, (long long)low), (int)min(f.hi, (long long)high), res);
+}
+
+bool LfcaSnapshot::hasNext() {
+    Frame f;
+    while (nextValue == values.size()) {
+        if (!next_base(&f)) {
+            return false;
+        }
+
+        values.clear();
+        nextValue = 0;
+        base_values(f, &values);
+        sort(values.begin(), values.end());
+    }
+
+    return true;
+}
+
+void LfcaSnapshot::appendRemaining(vector<int> *res) {
+    res->insert(res->end(), values.begin() + nextValue, values.end());
+    values.clear();
+    nextValue = 0;
+
+    Frame f;
+    while (next_base(&f)) {
+        base_values(f, res);
+    }
+}
+
+int LfcaSnapshot::next() {
+    if (!hasNext()) {
+        throw out_of_range("There are no more values in the snapshot");
+    }
+
+    return values[nextValue++];
+}
+
+long long LfcaSnapshot::timestamp() {
+    return ts;
+}
+
 // Range query helper
-node *find_next_base_stack(stack<node *> *s) {
+node *find_next_base_stack(TraversalStack *s) {
     node *base = s->top();
     s->pop();
 
@@ -215,53 +1042,50 @@ node *find_next_base_stack(stack<node *> *s) {
     node *t = s->top();
 
     if (t->left.load() == base) {
-        return leftmost_and_stack(t->right.load(), s);
+        return leftmost_and_stack(read_child(t, t->right), s);
     }
 
+    // Continue at the closest ancestor the traversal went left at. The traversal came from the right of t, and every ancestor it went right at has a smaller key than t.
+    // Multisets can have route nodes with equal keys, so the ancestor's key may be equal to t's key.
     int be_greater_than = t->key;
-    while (true) {
-        if (t->valid.load() && (t->key > be_greater_than)) {
-            return leftmost_and_stack(t->right.load(), s);
-        }
-        else {
-            s->pop();
+    s->pop();
 
-            // Stop looping if the stack is empty
-            if (s->empty()) {
-                break;
-            }
+    while (!s->empty()) {
+        t = s->top();
 
-            t = s->top();
+        if (t->valid.load() && (t->key >= be_greater_than)) {
+            return leftmost_and_stack(read_child(t, t->right), s);
         }
+
+        s->pop();
     }
 
     return nullptr;
 }
 
 node *new_range_base(node *b, int lo, int hi, rs *s) {
-    // Copy the other node
-    node *new_base = node::New(*b);
-
-    // Set fields
+    node *new_base = clone_base(b, range);
     new_base->lo = lo;
     new_base->hi = hi;
     new_base->storage = s;
+    init_version(new_base, b->parent, b);
 
     return new_base;
 }
 
 vector<int> LfcaTree::all_in_range(int lo, int hi, rs *help_s) {
-    stack<node *> s;
-    stack<node *> backup_s;
-    vector<node *> done;
+    RangeQueryBuffersLease lease;
+    TraversalStack &s = lease.buffers->s;
+    TraversalStack::Checkpoint backup_s;
+    vector<node *> &done = lease.buffers->done;
     node *b;
     rs *my_s;
 
 find_first:
-    b = find_base_stack(root.load(), lo, &s);
+    b = find_base_stack(read_root(), lo, &s);
     if (help_s != nullptr) {
         if (b->type != range || help_s != b->storage) {
-            return *help_s->result.load();
+            return *help_s->result.load(memory_order_acquire);
         }
         else {
             my_s = help_s;
@@ -275,10 +1099,22 @@ find_first:
             goto find_first;
         }
 
+        trace(trace_range, n->data, lo, n->stat);
+
         replace_top(&s, n);
     }
-    else if (b->type == range && b->hi >= hi) {
-        return all_in_range(b->lo, b->hi, b->storage);
+    else if (b->type == range && b->lo <= lo && b->hi >= hi) {
+        // A range query covering this one froze the base node. Its result, narrowed to this range, is also a result of this range query.
+        trace(trace_range_reuse, b->data, lo, b->stat);
+
+        vector<int> res;
+        for (int i : all_in_range(b->lo, b->hi, b->storage)) {
+            if (i >= lo && i <= hi) {
+                res.push_back(i);
+            }
+        }
+
+        return res;
     }
     else {
         help_if_needed(b);
@@ -287,7 +1123,7 @@ find_first:
 
     while (true) {  // Find remaining base nodes
         done.push_back(b);
-        backup_s = s;  // Backup the result set
+        backup_s = s.checkpoint();  // Backup the traversal stack
 
         // Stop looping if this treap is the last treap to consider for the range query
         if (!(b->data->getSize() == 0)) {
@@ -301,8 +1137,8 @@ find_first:
         if (b == nullptr) {
             break;
         }
-        else if (my_s->result.load() != NOT_SET) {
-            return *my_s->result.load();
+        else if (my_s->result.load(memory_order_acquire) != NOT_SET) {
+            return *my_s->result.load(memory_order_acquire);
         }
         else if (b->type == range && b->storage == my_s) {
             continue;
@@ -311,32 +1147,32 @@ find_first:
             node *n = new_range_base(b, lo, hi, my_s);
 
             if (try_replace(b, n)) {
+                trace(trace_range, n->data, lo, n->stat);
                 replace_top(&s, n);
                 continue;
             }
             else {
-                s = backup_s;  // Restore the result set from backup
+                s.restore(backup_s);  // Restore the traversal stack from backup
                 goto find_next_base_node;
             }
         }
         else {
             help_if_needed(b);
-            s = backup_s;  // Restore the result set from backup
+            s.restore(backup_s);  // Restore the traversal stack from backup
             goto find_next_base_node;
         }
     }
 
     // stack_array[0] gets the item at the bottom of the stack. Replicate this with a vector
-    vector<int> *res = new vector<int>(done.front()->data->rangeQuery(lo, hi));  // done->stack_array[0]->data;
-    for (size_t i = 1; i < done.size(); i++) {
-        vector<int> resTemp = done.at(i)->data->rangeQuery(lo, hi);
-        res->insert(end(*res), begin(resTemp), end(resTemp));
+    vector<int> *res = new vector<int>();
+    for (size_t i = 0; i < done.size(); i++) {
+        done.at(i)->data->rangeQuery(lo, hi, res);
     }
 
     vector<int> *expectedResult = NOT_SET;
-    if (my_s->result.compare_exchange_strong(expectedResult, res)) {
+    if (my_s->result.compare_exchange_strong(expectedResult, res, memory_order_acq_rel, memory_order_acquire)) {
         if (done.size() > 1) {
-            my_s->more_than_one_base.store(true);
+            my_s->more_than_one_base.store(true, memory_order_relaxed);
         }
     }
     else {
@@ -347,17 +1183,144 @@ find_first:
     // This call, which randomly adapts a base node from the range query, is ignored.
     // adapt_if_needed(t, done->array[r() % done->size]);
 
-    return *my_s->result.load();
+    return *my_s->result.load(memory_order_acquire);
+}
+
+// Multi-key operations. The base nodes of the keys are frozen in key order, like range queries, and any thread that finds a frozen base node helps to finish the operation.
+// The outcome is decided once every base node is frozen, and the new items are installed afterwards.
+bool LfcaTree::do_multi_update(multi_op op, int key0, int key1) {
+    ms *m = ms::New();
+    m->op = op;
+    m->keys[0] = key0;
+    m->keys[1] = key1;
+
+    return multi_update(m)->result;
+}
+
+multi_result *LfcaTree::multi_update(ms *m) {
+    int keys[MULTI_KEYS] = {min(m->keys[0], m->keys[1]), max(m->keys[0], m->keys[1])};
+    node *frozen[MULTI_KEYS];
+    int count = 0;
+
+    for (int i = 0; i < MULTI_KEYS; i++) {
+        while (m->result.load(memory_order_acquire) == nullptr) {
+            node *b = find_base_node(read_root(), keys[i]);
+
+            if (b->type == multi && b->multi_storage == m) {
+                // Already frozen, possibly for the previous key
+                if (count == 0 || frozen[count - 1] != b) {
+                    frozen[count++] = b;
+                }
+                break;
+            }
+            else if (is_replaceable(b)) {
+                // Operations insert at most one item, so make room for it before freezing
+                if (b->data->getSize() >= TREAP_NODES) {
+                    make_room(b, keys[i]);
+                    continue;
+                }
+
+                node *n = clone_base(b, multi);
+                n->multi_storage = m;
+                init_version(n, b->parent, b);
+
+                if (try_replace(b, n)) {
+                    frozen[count++] = n;
+                    break;
+                }
+            }
+            else {
+                help_if_needed(b);
+            }
+        }
+    }
+
+    if (m->result.load(memory_order_acquire) == nullptr) {
+        multi_result *res = new multi_result();
+        res->count = count;
+        for (int i = 0; i < count; i++) {
+            res->frozen[i] = frozen[i];
+            res->data[i] = frozen[i]->data;
+        }
+
+        // The item with keys[1] is in the last frozen base node
+        int index0 = m->keys[0] == keys[0] ? 0 : count - 1;
+        int index1 = m->keys[1] == keys[0] ? 0 : count - 1;
+        bool present0 = res->data[index0]->contains(m->keys[0]);
+        bool present1 = res->data[index1]->contains(m->keys[1]);
+        bool removed;
+
+        switch (m->op) {
+            case multi_insert_if_absent:
+                res->result = !present0 && !present1;
+                if (res->result) {
+                    res->data[index0] = res->data[index0]->immutableInsert(m->keys[0]);
+                }
+                break;
+
+            case multi_move:
+                res->result = present0 && !present1;
+                if (res->result) {
+                    res->data[index0] = res->data[index0]->immutableRemove(m->keys[0], &removed);
+                    res->data[index1] = res->data[index1]->immutableInsert(m->keys[1]);
+                }
+                break;
+
+            case multi_compare_and_swap:
+                res->result = present0;
+                if (res->result) {
+                    res->data[index0] = res->data[index0]->immutableRemove(m->keys[0], &removed);
+                    if (!res->data[index1]->contains(m->keys[1])) {
+                        res->data[index1] = res->data[index1]->immutableInsert(m->keys[1]);
+                    }
+                }
+                break;
+        }
+
+        multi_result *expected = nullptr;
+        if (!m->result.compare_exchange_strong(expected, res)) {
+            // Another thread decided first
+            delete res;
+        }
+    }
+
+    multi_result *res = m->result.load(memory_order_acquire);
+    init_ts(res->ts);
+
+    // Install the decided items. Also release base nodes this thread froze after another thread decided the outcome.
+    for (int i = 0; i < res->count; i++) {
+        release_multi(res->frozen[i]);
+    }
+    for (int i = 0; i < count; i++) {
+        release_multi(frozen[i]);
+    }
+
+    return res;
 }
 
-// Contention adaptation
-node *LfcaTree::secure_join(node *b, bool left) {
+void LfcaTree::release_multi(node *n) {
+    if (!is_parent_of(n->parent, n)) {
+        return;  // Already released
+    }
+
+    node *newb = node::New();
+    newb->type = normal;
+    newb->parent = n->parent;
+    newb->data = current_data(n);
+    newb->stat = n->stat;
+    init_version(newb, n->parent, n);
+
+    try_replace(n, newb);
+}
+
+// Contention adaptation. The join protocol (valid, join_id and neigh2) keeps seq_cst, since a join claims one of these and then reads another, which acquire and release do not order.
+node *LfcaTree::secure_join(node *b, bool left, node *gparent_hint) {
     node *n0;
     if (left) {
-        n0 = leftmost(b->parent->right.load());
+        n0 = leftmost(read_child(b->parent, b->parent->right));
     }
     else {
-        n0 = rightmost(b->parent->left.load());
+        n0 = rightmost(read_child(b->parent, b->parent->left));
     }
 
     if (!is_replaceable(n0)) {
@@ -369,58 +1332,71 @@ node *LfcaTree::secure_join(node *b, bool left) {
         return nullptr;
     }
 
-    node *m = node::New(*b);  // Copy b
-    m->type = join_main;
+    node *m = clone_base(b, join_main);
+    init_version(m, b->parent, b);
 
-    node *expectedNode = b;
     if (left) {
-        if (!b->parent->left.compare_exchange_strong(expectedNode, m)) {
+        if (!versioned_cas(b->parent, b->parent->left, b, m)) {
             return nullptr;
         }
     }
     else {
-        if (!b->parent->right.compare_exchange_strong(expectedNode, m)) {
+        if (!versioned_cas(b->parent, b->parent->right, b, m)) {
             return nullptr;
         }
     }
 
-    node *n1 = node::New(*n0);  // Copy n0
-    n1->type = join_neighbor;
+    node *n1 = clone_base(n0, join_neighbor);
     n1->main_node = m;
+    init_version(n1, n0->parent, n0);
 
     if (!try_replace(n0, n1)) {
         m->neigh2.store(ABORTED);
+        trace(trace_abort, m->data, m->parent->key, m->stat);
         return nullptr;
     }
 
-    expectedNode = nullptr;
+    node *expectedNode = nullptr;
     if (!m->parent->join_id.compare_exchange_strong(expectedNode, m)) {
         m->neigh2.store(ABORTED);
+        trace(trace_abort, m->data, m->parent->key, m->stat);
         return nullptr;
     }
 
-    node *gparent = parent_of(m->parent);
+    // Use the grandparent seen while searching for b if it is still the parent's parent, to avoid searching the tree again.
+    // If the hint is removed from the tree after this check, its join_id stays set and securing it below fails.
+    node *gparent;
+    if (is_parent_of(gparent_hint, m->parent)) {
+        gparent = gparent_hint;
+    }
+    else {
+        gparent = parent_of(m->parent);
+    }
+
     expectedNode = nullptr;
     if (gparent == NOT_FOUND || (gparent != nullptr && !gparent->join_id.compare_exchange_strong(expectedNode, m))) {
         m->parent->join_id.store(nullptr);
         m->neigh2.store(ABORTED);
+        trace(trace_abort, m->data, m->parent->key, m->stat);
         return nullptr;
     }
 
     m->gparent = gparent;
+    m->join_version.owner = gparent;
+    m->join_version.prev = m->parent;
     if (left) {
-        m->otherb = m->parent->right.load();
+        m->otherb = read_child(m->parent, m->parent->right);
     }
     else {
-        m->otherb = m->parent->left.load();
+        m->otherb = read_child(m->parent, m->parent->left);
     }
     m->neigh1 = n1;
 
     node *joinedp = m->otherb == n1 ? gparent : n1->parent;
-    node *newNeigh2 = node::New(*n1);  // Copy n1
-    newNeigh2->type = join_neighbor;
+    node *newNeigh2 = clone_base(n1, join_neighbor);
     newNeigh2->parent = joinedp;
     newNeigh2->main_node = m;
+    init_version(newNeigh2, n1->parent, n1);
 
     if (left) {
         // The main node has smaller values
@@ -433,6 +1409,7 @@ node *LfcaTree::secure_join(node *b, bool left) {
 
     expectedNode = PREPARING;
     if (m->neigh2.compare_exchange_strong(expectedNode, newNeigh2)) {
+        trace(trace_join, newNeigh2->data, m->parent->key, m->stat);
         return m;
     }
 
@@ -442,6 +1419,7 @@ node *LfcaTree::secure_join(node *b, bool left) {
 
     m->parent->join_id.store(nullptr);
     m->neigh2.store(ABORTED);
+    trace(trace_abort, m->data, m->parent->key, m->stat);
     return nullptr;
 }
 
@@ -456,41 +1434,40 @@ void LfcaTree::complete_join(node *m) {
     m->parent->valid.store(false);
 
     node *replacement = m->otherb == m->neigh1 ? n2 : m->otherb;
+    add_version(replacement, &m->join_version);
+
     if (m->gparent == nullptr) {
-        node *expected = m->parent;
-        root.compare_exchange_strong(expected, replacement);
+        versioned_cas(nullptr, root, m->parent, replacement);
     }
     else if (m->gparent->left.load() == m->parent) {
-        node *expected = m->parent;
-        m->gparent->left.compare_exchange_strong(expected, replacement);
+        versioned_cas(m->gparent, m->gparent->left, m->parent, replacement);
 
-        expected = m;
+        node *expected = m;
         m->gparent->join_id.compare_exchange_strong(expected, nullptr);
     }
     else if (m->gparent->right.load() == m->parent) {
-        node *expected = m->parent;
-        m->gparent->right.compare_exchange_strong(expected, replacement);
+        versioned_cas(m->gparent, m->gparent->right, m->parent, replacement);
 
-        expected = m;
+        node *expected = m;
         m->gparent->join_id.compare_exchange_strong(expected, nullptr);
     }
 
     m->neigh2.store(DONE);
 }
 
-void LfcaTree::low_contention_adaptation(node *b) {
+void LfcaTree::low_contention_adaptation(node *b, node *gparent_hint) {
     if (b->parent == nullptr) {
         return;
     }
 
     if (b->parent->left.load() == b) {
-        node *m = secure_join(b, true);
+        node *m = secure_join(b, true, gparent_hint);
         if (m != nullptr) {
             complete_join(m);
         }
     }
     else if (b->parent->right.load() == b) {
-        node *m = secure_join(b, false);
+        node *m = secure_join(b, false, gparent_hint);
         if (m != nullptr) {
             complete_join(m);
         }
@@ -498,27 +1475,53 @@ void LfcaTree::low_contention_adaptation(node *b) {
 }
 
 void LfcaTree::high_contention_adaptation(node *b) {
-    // Don't split treaps that have too few items
-    if (b->data->getSize() < 2) {
+    // Don't split treaps that have too few items, or only copies of one value (a multiset), which a split cannot separate
+    if (b->data->getSize() < 2 || b->data->getMinValue() == b->data->getMaxValue()) {
         return;
     }
 
-    // Create new route node
-    node *r = node::New();
-    r->type = route;
-    r->valid = true;
-
     // Split the treap
     Treap *leftTreap;
     Treap *rightTreap;
     int splitVal = b->data->split(&leftTreap, &rightTreap);
 
+    split_base(b, splitVal, leftTreap, rightTreap);
+}
+
+// Splits a full base node so that i can be added to it
+void LfcaTree::make_room(node *b, int i) {
+    int val = b->data->getMinValue();
+    if (val != b->data->getMaxValue()) {
+        high_contention_adaptation(b);
+        return;
+    }
+
+    // Only multisets fill a treap with a single value. Splitting at the median cannot separate equal values, so split off an empty base node for i instead
+    if (i == val) {
+        throw out_of_range("Cannot insert " + to_string(i) + ": Too many copies of the value");
+    }
+    else if (i < val) {
+        split_base(b, i, Treap::New(), b->data);
+    }
+    else {
+        split_base(b, val, b->data, Treap::New());
+    }
+}
+
+void LfcaTree::split_base(node *b, int splitVal, Treap *leftTreap, Treap *rightTreap) {
+    // Create new route node
+    node *r = node::New();
+    r->type = route;
+    r->valid = true;
+    init_version(r, b->parent, b);
+
     // Create left base node
     node *leftNode = node::New();
     leftNode->type = normal;
     leftNode->parent = r;
     leftNode->stat = 0;
     leftNode->data = leftTreap;
+    init_version(leftNode, r, nullptr, 0);
 
     // Create right base node
     node *rightNode = node::New();
@@ -526,43 +1529,86 @@ void LfcaTree::high_contention_adaptation(node *b) {
     rightNode->parent = r;
     rightNode->stat = 0;
     rightNode->data = rightTreap;
+    init_version(rightNode, r, nullptr, 0);
 
     // Add the treaps to the route node
     r->key = splitVal;
     r->left = leftNode;
     r->right = rightNode;
 
-    try_replace(b, r);
+    if (try_replace(b, r)) {
+        trace(trace_split, b->data, splitVal, b->stat);
+    }
 }
 
 // Auxilary functions
 node *find_base_node(node *n, int i) {
     while (n->type == route) {
         if (i <= n->key) {
-            n = n->left.load();
+            n = read_child(n, n->left);
         }
         else {
-            n = n->right.load();
+            n = read_child(n, n->right);
         }
     }
 
     return n;
 }
 
-node *find_base_stack(node *n, int i, stack<node *> *s) {
-    // Empty the stack
-    while (s->size() > 0) {
-        s->pop();
+// Same as find_base_node, also returning the parent of the base node's parent (nullptr if there is none)
+node *find_base_node(node *n, int i, node **gparent) {
+    node *parent = nullptr;
+    *gparent = nullptr;
+
+    while (n->type == route) {
+        *gparent = parent;
+        parent = n;
+
+        if (i <= n->key) {
+            n = read_child(n, n->left);
+        }
+        else {
+            n = read_child(n, n->right);
+        }
+    }
+
+    return n;
+}
+
+// Same as find_base_node, also returning the largest value the base node can hold
+node *find_base_node(node *n, int i, node **gparent, long long *hi) {
+    node *parent = nullptr;
+    *gparent = nullptr;
+    *hi = LLONG_MAX;
+
+    while (n->type == route) {
+        *gparent = parent;
+        parent = n;
+
+        if (i <= n->key) {
+            *hi = n->key;
+            n = read_child(n, n->left);
+        }
+        else {
+            n = read_child(n, n->right);
+        }
     }
 
+    return n;
+}
+
+node *find_base_stack(node *n, int i, TraversalStack *s) {
+    // Empty the stack
+    s->clear();
+
     while (n->type == route) {
         s->push(n);
 
-        if (i < n->key) {
-            n = n->left.load();
+        if (i <= n->key) {
+            n = read_child(n, n->left);
         }
         else {
-            n = n->right.load();
+            n = read_child(n, n->right);
         }
     }
 
@@ -570,27 +1616,35 @@ node *find_base_stack(node *n, int i, stack<node *> *s) {
     return n;
 }
 
-node *leftmost_and_stack(node *n, stack<node *> *s) {
+node *leftmost_and_stack(node *n, TraversalStack *s) {
     while (n->type == route) {
         s->push(n);
-        n = n->left.load();
+        n = read_child(n, n->left);
     }
 
     s->push(n);
     return n;
 }
 
+bool LfcaTree::is_parent_of(node *p, node *n) {
+    if (p == nullptr) {
+        return root.load() == n;
+    }
+
+    return p->left.load() == n || p->right.load() == n;
+}
+
 node *LfcaTree::parent_of(node *n) {
     node *prev_node = nullptr;
-    node *curr_node = root.load();
+    node *curr_node = read_root();
 
     while (curr_node != n && curr_node->type == route) {
         prev_node = curr_node;
         if (n->key < curr_node->key) {
-            curr_node = curr_node->left.load();
+            curr_node = read_child(curr_node, curr_node->left);
         }
         else {
-            curr_node = curr_node->right.load();
+            curr_node = read_child(curr_node, curr_node->right);
         }
     }
 
@@ -2,8 +2,12 @@
 #define _LFCA_H
 
 #include <atomic>
+#include <cstddef>
+#include <map>
+#include <ostream>
 #include <vector>
 
+#include "lfcatrace.h"
 #include "searchtree.h"
 #include "treap.h"
 #include "preallocatable.h"
@@ -19,6 +23,15 @@
 #define PREPARING (node *)0       // Used for join
 #define DONE (node *)1            // ...
 #define ABORTED (node *)2         // ...
+#define TS_UNSET -1               // Timestamp of a slot version that has not been stamped yet
+#define MULTI_KEYS 2              // Keys used by a multi-key operation
+#define ELIMINATION_SLOTS 16      // Size of the elimination array
+#define ELIMINATION_SPINS 128     // Times an offer in the elimination array is checked before it is withdrawn
+#define ELIMINATION_CONT CONT_CONTRIB  // Statistics value from which updates that fail to replace a base node try elimination
+#define NODE_ALIGNMENT 64         // Cache line size
+#define LOOKUP_GROUP 16           // Lookups interleaved by lookupBatch
+#define COMBINING_SPINS 128       // Times a combiner checks for other published updates before it closes the publication list
+#define FC_CLOSED (fc *)1         // Publication list that is being combined
 
 enum contention_info {
     contended,
@@ -31,7 +44,25 @@ enum node_type {
     normal,
     join_main,
     join_neighbor,
-    range
+    range,
+    multi
+};
+
+enum update_type {
+    update_insert,
+    update_remove
+};
+
+enum fc_state {
+    fc_pending,  // Published and waiting for a combiner
+    fc_done,     // Applied by a combiner
+    fc_retry     // Not applied, because the base node was replaced or the treap is full
+};
+
+enum multi_op {
+    multi_insert_if_absent,  // Insert keys[0] if keys[1] is absent
+    multi_move,              // Replace keys[0] with keys[1] if keys[0] is present and keys[1] is absent
+    multi_compare_and_swap   // Replace keys[0] with keys[1] if keys[0] is present
 };
 
 // Data Structures
@@ -55,24 +86,80 @@ struct rs : public Preallocatable<rs> {                                 // Resul
     }
 };
 
-struct node : public Preallocatable<node> {
+struct node;
+
+// A version of a child slot (root, left or right). Records which node the slot held before, and when it was replaced.
+struct slot_version {
+    atomic<long long> ts{TS_UNSET};           // Time the slot was changed. First, since traversals check it on every hop
+    atomic<slot_version *> next{nullptr};  // Other versions of the same node
+    node *owner = nullptr;                    // Route node owning the slot, or NULL (root)
+    node *prev = nullptr;                     // Node the slot held before
+};
+
+// Outcome of a multi-key operation, decided once the base nodes of all of its keys are frozen
+struct multi_result {
+    bool result;
+    int count;                       // Number of frozen base nodes
+    node *frozen[MULTI_KEYS];        // The frozen base nodes, in key order
+    Treap *data[MULTI_KEYS];         // Items of each frozen base node after the operation
+    atomic<long long> ts{TS_UNSET};  // Time the outcome was decided, stamped like a slot version
+};
+
+struct ms : public Preallocatable<ms> {  // Storage for multi-key operations
+    multi_op op;
+    int keys[MULTI_KEYS];
+    atomic<multi_result *> result{nullptr};  // The outcome, once decided
+
+    ~ms() {
+        delete result.load();
+    }
+};
+
+struct fc {  // An update published for flat combining. Owned by the publishing thread, which waits until it is no longer pending
+    Treap *(*u)(Treap *, int, bool *);  // The update function
+    int key;
+    bool result;
+    atomic<fc_state> state{fc_pending};
+    fc *next = nullptr;  // Next update in the publication list
+};
+
+struct batch_update {  // An update applied by LfcaTree::updateBatch
+    update_type type;
+    int key;
+};
+
+// The fields read by traversals and lookups (type, key, left, right, data, moved and version.ts) are kept together in the first cache line.
+// The owner and prev of the version are only read when stamping a slot, and fall into the second line.
+struct alignas(NODE_ALIGNMENT) node : public Preallocatable<node> {
+    // node
+    node_type type;
+
     // route_node
     int key{0};                          // Split key
     atomic<node *> left{nullptr};              // < key
     atomic<node *> right{nullptr};             // >= key
-    atomic<bool> valid{true};         // Used for join
-    atomic<node *> join_id{nullptr};  // ...
 
     // normal_base
     Treap *data = nullptr;   // Items in the set
+
+    // Versions of the slots this node has been installed into, used for snapshots. These are never copied.
+    atomic<slot_version *> moved{nullptr};  // Slots the node was moved into by joins
+    slot_version version;                    // The slot the node was first installed into
+
+    // normal_base
     int stat = 0;            // Statistics variable
     node *parent = nullptr;  // Parent node or NULL (root)
 
+    // route_node
+    atomic<bool> valid{true};         // Used for join
+    atomic<node *> join_id{nullptr};  // ...
+
     // join_main
     node *neigh1 = nullptr;                      // First (not joined) neighbor base
     atomic<node *> neigh2{PREPARING};  // Joined n... (neighbor?)
     node *gparent = nullptr;                     // Grand parent
     node *otherb= nullptr;                      // Other branch
+    slot_version join_version;                   // Version of the grand parent's slot once the parent is removed
 
     // join_neighbor
     node *main_node = nullptr;  // The main node for the join
@@ -82,8 +169,11 @@ struct node : public Preallocatable<node> {
     int hi = 0;  // Low and high key
     rs *storage = nullptr;
 
-    // node
-    node_type type;
+    // multi_base
+    ms *multi_storage = nullptr;
+
+    // Updates published to a normal base node for flat combining. Never copied, so every publication list is combined at most once.
+    atomic<fc *> pending{nullptr};
 
     node *operator=(const node &other) {
         key = other.key;
@@ -107,34 +197,183 @@ struct node : public Preallocatable<node> {
         hi = other.hi;
         storage = other.storage;  // Link to the same result storage, so that all nodes in the same range query contain the result set when it is stored.
 
+        multi_storage = other.multi_storage;
+
         type = other.type;
 
         return this;
     }
 };
 
+// A field inserted before these would push them out of the first cache line, and every hop would read two lines again
+static_assert(offsetof(node, type) + sizeof(node_type) <= NODE_ALIGNMENT && offsetof(node, key) + sizeof(int) <= NODE_ALIGNMENT
+                  && offsetof(node, left) + sizeof(atomic<node *>) <= NODE_ALIGNMENT && offsetof(node, right) + sizeof(atomic<node *>) <= NODE_ALIGNMENT
+                  && offsetof(node, data) + sizeof(Treap *) <= NODE_ALIGNMENT && offsetof(node, moved) + sizeof(atomic<slot_version *>) <= NODE_ALIGNMENT
+                  && offsetof(node, version.ts) + sizeof(atomic<long long>) <= NODE_ALIGNMENT,
+              "The fields read by traversals must stay in the first cache line of a node");
+
+// Shape of the tree, as reported by LfcaTree::describe
+struct LfcaTreeDescription {
+    int height{0};                    // Route nodes on the longest path from the root to a base node
+    int routeNodes{0};                // ...
+    int baseNodes{0};                 // ...
+    std::vector<int> sizeHistogram;   // sizeHistogram[s] is the number of base nodes holding s items
+    std::map<int, int> statHistogram;  // Number of base nodes per statistics value
+};
+
+/**
+ * An in-order iterator over the values of an LfcaTree at the moment the snapshot was taken.
+ * Base nodes are visited one at a time, and updates to the tree made after the snapshot are not seen.
+ * Taking and walking a snapshot never blocks updates.
+ */
+class LfcaSnapshot {
+private:
+    struct Frame {
+        node *n;
+        long long lo;  // Values in the subtree are greater than lo
+        long long hi;  // ... and at most hi
+    };
+
+    long long ts;
+    int low;
+    int high;
+    std::vector<Frame> nodesToVisit;
+    std::vector<int> values;  // Values of the current base node
+    size_t nextValue{0};
+
+    bool next_base(Frame *f);
+    void base_values(const Frame &f, std::vector<int> *res);
+
+public:
+    LfcaSnapshot(node *root, long long ts, int low, int high);
+
+    bool hasNext();
+    void appendRemaining(std::vector<int> *res);  // Appends the values not yet returned, in no particular order
+    int next();
+    long long timestamp();
+};
+
 class LfcaTree : public SearchTree {
 private:
     std::atomic<node *> root{nullptr};
+    std::atomic<bool> tracing{false};
+    int traceId;
+    bool mvccRangeQueries;
+    bool multiset;
+    std::atomic<bool> elimination{false};
+    std::atomic<unsigned long long> eliminationSlots[ELIMINATION_SLOTS];  // Packed offers, see try_eliminate
+    std::atomic<bool> combining{false};
 
-    bool do_update(Treap *(*u)(Treap *, int, bool *), int i);
+    node *read_root();
+    bool do_update(Treap *(*u)(Treap *, int, bool *), int i, update_type type);
+    bool try_eliminate(int i, update_type type);
+    fc_state combine(node *b, fc *op, node *gparent);
+    void apply_updates(node *b, fc *ops, node *gparent, contention_info info);
     std::vector<int> all_in_range(int lo, int hi, rs *help_s);
     bool try_replace(node *b, node *new_b);
-    node *secure_join(node *b, bool left);
+    node *secure_join(node *b, bool left, node *gparent_hint);
     void complete_join(node *m);
     node *parent_of(node *n);
-    void adapt_if_needed(node *b);
-    void low_contention_adaptation(node *b);
+    bool is_parent_of(node *p, node *n);
+    void adapt_if_needed(node *b, node *gparent_hint);
+    void low_contention_adaptation(node *b, node *gparent_hint);
     void high_contention_adaptation(node *b);
+    void make_room(node *b, int i);
+    void split_base(node *b, int splitVal, Treap *leftTreap, Treap *rightTreap);
     void help_if_needed(node *n);
+    multi_result *multi_update(ms *m);
+    void release_multi(node *n);
+    bool do_multi_update(multi_op op, int key0, int key1);
+    void trace(trace_event_type type, Treap *data, int key, int stat);
 
 public:
-    LfcaTree();
+    /**
+     * Creates an empty tree.
+     *
+     * @param mvccRangeQueries
+     * If true, range queries read a snapshot of the tree instead of replacing the base nodes in the range with range base nodes.
+     * These range queries never make updates help them.
+     * Slot versions are kept by every tree whatever this is, since snapshot() is always available.
+     * So every update records the version of the slot it changes, and every traversal stamps the slots it reads on each hop.
+     *
+     * @param multiset
+     * If true, inserting a value that is already in the tree adds another copy of it. Otherwise, such inserts do not change the tree.
+     * A multiset holds at most TREAP_NODES copies of a value.
+     */
+    LfcaTree(bool mvccRangeQueries = false, bool multiset = false);
 
-    void insert(int val);
+    bool insert(int val);
     bool remove(int val);
     bool lookup(int val);
     std::vector<int> rangeQuery(int low, int high);
+
+    /**
+     * Looks up many values. Up to LOOKUP_GROUP lookups are interleaved, and each prefetches the next node it reads,
+     * so that the cache misses of the lookups overlap instead of following each other.
+     * Each lookup is linearizable on its own.
+     *
+     * @param keys
+     * The values to look up.
+     *
+     * @param out
+     * The location to store whether each value is in the tree.
+     *
+     * @param n
+     * The number of values.
+     */
+    void lookupBatch(const int *keys, bool *out, size_t n);
+
+    bool insertIfAbsent(int val, int absent);
+    bool move(int from, int to);
+    bool compareAndSwap(int expected, int desired);
+
+    /**
+     * Applies a batch of inserts and removes. The updates are sorted by value, and the updates that fall into the same base node replace it once.
+     * Each update is linearizable on its own, but the batch as a whole is not atomic. Updates of the same value take effect in batch order.
+     *
+     * @param ops
+     * The updates to apply.
+     *
+     * @param results
+     * The location to store the result of each update, in the order of ops.
+     */
+    void updateBatch(const std::vector<batch_update> &ops, std::vector<bool> *results);
+
+    LfcaTreeDescription describe();
+    void dumpGraphviz(std::ostream &out);
+
+    LfcaSnapshot snapshot();
+    LfcaSnapshot snapshot(int low, int high);
+
+    /**
+     * Enables or disables elimination. When enabled, an insert and a remove of the same value that both fail to replace a contended base node
+     * can cancel each other out without changing the tree.
+     *
+     * @param enabled
+     * Whether to use elimination.
+     */
+    void setElimination(bool enabled);
+
+    /**
+     * Enables or disables flat combining. When enabled, an update that fails to replace a base node publishes itself in a list on the base node.
+     * One of the publishing threads then applies all published updates to a single new treap, and replaces the base node once for all of them.
+     * A base node whose updates are combined counts as uncontended, so hot base nodes with dense keys are batched instead of split.
+     * Combining makes updates blocking: a publishing thread waits until the combiner has applied its update, so a stalled combiner stalls them too.
+     *
+     * @param enabled
+     * Whether to combine updates.
+     */
+    void setCombining(bool enabled);
+
+    /**
+     * Enables or disables recording adaptations into the trace. Enabling it registers the calling thread with LfcaTrace::registerThread.
+     * Other threads must register themselves before their events are recorded.
+     *
+     * @param enabled
+     * Whether to trace adaptations.
+     */
+    void setTracing(bool enabled);
+    void dumpTrace(std::ostream &out);
 };
 
 #endif /* _LFCA_H */
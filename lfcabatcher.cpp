@@ -0,0 +1,76 @@
+/**
+ * @file lfcabatcher.cpp
+ *
+ * Per-thread batching of LfcaTree updates, with a size and a delay flush policy.
+ */
+
+#include "lfcabatcher.h"
+
+using namespace std;
+using namespace std::chrono;
+
+LfcaBatcher::LfcaBatcher(LfcaTree *tree, size_t maxBatchSize, microseconds maxDelay) : tree(tree), maxBatchSize(maxBatchSize), maxDelay(maxDelay) {
+    ops.reserve(maxBatchSize);
+    results.reserve(maxBatchSize);
+}
+
+LfcaBatcher::~LfcaBatcher() {
+    flush();
+}
+
+future<bool> LfcaBatcher::add(update_type type, int val) {
+    if (ops.empty()) {
+        oldest = steady_clock::now();
+    }
+
+    batch_update op;
+    op.type = type;
+    op.key = val;
+    ops.push_back(op);
+
+    results.push_back(promise<bool>());
+    future<bool> result = results.back().get_future();
+
+    if (ops.size() >= maxBatchSize) {
+        flush();
+    }
+    else {
+        poll();
+    }
+
+    return result;
+}
+
+future<bool> LfcaBatcher::insertAsync(int val) {
+    return add(update_insert, val);
+}
+
+future<bool> LfcaBatcher::removeAsync(int val) {
+    return add(update_remove, val);
+}
+
+void LfcaBatcher::poll() {
+    if (!ops.empty() && steady_clock::now() - oldest >= maxDelay) {
+        flush();
+    }
+}
+
+void LfcaBatcher::flush() {
+    if (ops.empty()) {
+        return;
+    }
+
+    vector<bool> batchResults;
+    tree->updateBatch(ops, &batchResults);
+
+    for (size_t i = 0; i < results.size(); i++) {
+        results[i].set_value(batchResults[i]);
+    }
+
+    ops.clear();
+    results.clear();
+}
+
+size_t LfcaBatcher::pending() {
+    return ops.size();
+}
@@ -0,0 +1,63 @@
+/**
+ * An asynchronous front-end that collects the inserts and removes of one thread and applies them to an LfcaTree in batches.
+ *
+ * Each update returns a future that becomes ready once its batch is applied. A batch is applied when it reaches the maximum batch size,
+ * or when its oldest update has waited longer than the maximum delay. The delay is only checked when the owning thread calls into the batcher,
+ * so an event loop (or a coroutine scheduler awaiting the futures) should call poll() regularly.
+ *
+ * A batcher must only be used by one thread. Each thread that updates the tree uses its own batcher.
+ */
+
+#ifndef _LFCABATCHER_H
+#define _LFCABATCHER_H
+
+#include <chrono>
+#include <future>
+#include <vector>
+
+#include "lfca.h"
+
+class LfcaBatcher {
+private:
+    LfcaTree *tree;
+    size_t maxBatchSize;
+    std::chrono::microseconds maxDelay;
+    std::vector<batch_update> ops;
+    std::vector<std::promise<bool>> results;
+    std::chrono::steady_clock::time_point oldest;  // Time the first update of the current batch was added
+
+    std::future<bool> add(update_type type, int val);
+
+public:
+    /**
+     * Creates a batcher for a tree.
+     *
+     * @param tree
+     * The tree to apply the updates to.
+     *
+     * @param maxBatchSize
+     * The number of updates at which a batch is applied.
+     *
+     * @param maxDelay
+     * The longest time an update waits before its batch is applied, as checked by poll() and by adding updates.
+     */
+    LfcaBatcher(LfcaTree *tree, size_t maxBatchSize = 64, std::chrono::microseconds maxDelay = std::chrono::microseconds(100));
+    ~LfcaBatcher();
+
+    std::future<bool> insertAsync(int val);
+    std::future<bool> removeAsync(int val);
+
+    /**
+     * Applies the current batch if its oldest update has waited longer than the maximum delay.
+     */
+    void poll();
+
+    /**
+     * Applies the current batch, making the futures of all added updates ready.
+     */
+    void flush();
+
+    size_t pending();
+};
+
+#endif /* _LFCABATCHER_H */
@@ -0,0 +1,120 @@
+/**
+ * @file lfcatrace.cpp
+ *
+ * Per-thread ring buffers for tracing LFCA tree adaptations, and the Chrome trace JSON export.
+ */
+
+#include "lfcatrace.h"
+
+#include <chrono>
+#include <cstdio>
+
+using namespace std;
+using namespace std::chrono;
+
+static const char *eventNames[] = {"split", "join", "abort", "range", "range_reuse", "combine", "eliminate"};
+
+static steady_clock::time_point traceEpoch = steady_clock::now();
+
+/**
+ * Releases the calling thread's buffer when the thread exits, so that it can be reused by a new thread.
+ */
+struct BufferReleaser {
+    atomic<bool> *inUse{nullptr};
+
+    ~BufferReleaser() {
+        if (inUse != nullptr) {
+            inUse->store(false, memory_order_release);
+        }
+    }
+};
+
+atomic<LfcaTrace::Buffer *> &LfcaTrace::registry() {
+    static atomic<Buffer *> _val{nullptr};
+    return _val;
+}
+
+LfcaTrace::Buffer *&LfcaTrace::threadBuffer() {
+    static thread_local Buffer *buffer = nullptr;
+    return buffer;
+}
+
+void LfcaTrace::registerThread() {
+    static thread_local BufferReleaser releaser;
+    Buffer *&buffer = threadBuffer();
+
+    if (buffer != nullptr) {
+        return;
+    }
+
+    // Reuse the buffer of a thread that has exited, if there is one
+    for (Buffer *b = registry().load(memory_order_acquire); b != nullptr; b = b->next) {
+        bool expected = false;
+        if (!b->inUse.load(memory_order_relaxed) && b->inUse.compare_exchange_strong(expected, true)) {
+            buffer = b;
+            releaser.inUse = &b->inUse;
+            return;
+        }
+    }
+
+    // Register a new buffer
+    Buffer *b = new Buffer();
+    // Acquired, since the index of the new buffer is read from the head
+    Buffer *head = registry().load(memory_order_acquire);
+    do {
+        b->next = head;
+        b->threadIndex = head == nullptr ? 0 : head->threadIndex + 1;
+    } while (!registry().compare_exchange_weak(head, b, memory_order_acq_rel, memory_order_acquire));
+
+    buffer = b;
+    releaser.inUse = &b->inUse;
+}
+
+void LfcaTrace::record(TraceEvent event) {
+    Buffer *b = threadBuffer();
+    if (b == nullptr) {
+        return;
+    }
+
+    event.timestamp = duration_cast<nanoseconds>(steady_clock::now() - traceEpoch).count();
+
+    // Only the owning thread writes to the buffer, so a plain increment is enough
+    unsigned long long index = b->count.load(memory_order_relaxed);
+    b->events[index & (TRACE_BUFFER_SIZE - 1)] = event;
+    b->count.store(index + 1, memory_order_release);
+}
+
+void LfcaTrace::dumpChromeJson(int treeId, ostream &out) {
+    bool first = true;
+
+    out << "{\"traceEvents\":[";
+
+    for (Buffer *b = registry().load(memory_order_acquire); b != nullptr; b = b->next) {
+        unsigned long long count = b->count.load(memory_order_acquire);
+        unsigned long long start = count > TRACE_BUFFER_SIZE ? count - TRACE_BUFFER_SIZE : 0;
+
+        for (unsigned long long i = start; i < count; i++) {
+            const TraceEvent &e = b->events[i & (TRACE_BUFFER_SIZE - 1)];
+            if (e.treeId != treeId) {
+                continue;
+            }
+
+            char timestamp[32];
+            snprintf(timestamp, sizeof(timestamp), "%lld.%03lld", e.timestamp / 1000, e.timestamp % 1000);  // Microseconds
+
+            out << (first ? "" : ",") << "\n"
+                << "{\"name\":\"" << eventNames[e.type] << "\",\"cat\":\"lfca\",\"ph\":\"i\",\"s\":\"t\""
+                << ",\"ts\":" << timestamp
+                << ",\"pid\":" << treeId << ",\"tid\":" << b->threadIndex
+                << ",\"args\":{\"lo\":" << e.lo << ",\"hi\":" << e.hi << ",\"key\":" << e.key << ",\"stat\":" << e.stat << ",\"size\":" << e.size << "}}";
+            first = false;
+        }
+    }
+
+    out << "\n],\"displayTimeUnit\":\"ns\"}\n";
+}
+
+int LfcaTrace::newTreeId() {
+    static atomic<int> nextId{1};
+    return nextId.fetch_add(1);
+}
@@ -0,0 +1,90 @@
+/**
+ * A bounded, per-thread event trace for the contention adaptations performed by the LFCA tree.
+ *
+ * Each thread records into its own fixed-size ring buffer, which it registers with registerThread before it traces.
+ * Recording an event is then a wait-free store into the ring buffer that never allocates. Events of threads that have not registered are dropped.
+ * When a ring buffer is full, the oldest events of that thread are overwritten.
+ * Buffers are recycled when their thread exits, so memory is bounded by the number of threads that trace at the same time.
+ *
+ * The recorded events can be exported as Chrome trace JSON (chrome://tracing, Perfetto) once the traced threads are quiescent.
+ */
+
+#ifndef _LFCATRACE_H
+#define _LFCATRACE_H
+
+#include <atomic>
+#include <ostream>
+
+#define TRACE_BUFFER_SIZE 4096  // Events kept per thread. Must be a power of 2
+
+enum trace_event_type {
+    trace_split,
+    trace_join,
+    trace_abort,
+    trace_range,
+    trace_range_reuse,
+    trace_combine,
+    trace_eliminate
+};
+
+struct TraceEvent {
+    trace_event_type type;
+    long long timestamp;  // Nanoseconds since the trace epoch
+    int treeId;           // The tree that recorded the event
+    int lo;               // Lowest key in the adapted base node
+    int hi;               // Highest key in the adapted base node
+    int key;              // Route key of a split, join or abort, or the low key of a range query or of a reused range query result, the first of several combined updates, or an eliminated value
+    int stat;             // Statistics variable of the adapted base node
+    int size;             // Number of items in the adapted base node
+};
+
+class LfcaTrace {
+private:
+    struct Buffer {
+        TraceEvent events[TRACE_BUFFER_SIZE];
+        std::atomic<unsigned long long> count{0};  // Number of events ever recorded into this buffer
+        std::atomic<bool> inUse{true};
+        int threadIndex{0};
+        Buffer *next{nullptr};  // Registry link
+    };
+
+    static std::atomic<Buffer *> &registry();
+    static Buffer *&threadBuffer();
+
+public:
+    /**
+     * Gives the calling thread a ring buffer to record into, reusing the buffer of an exited thread if there is one.
+     * This may allocate, so it is kept out of the recording path. Calling it again on the same thread does nothing.
+     */
+    static void registerThread();
+
+    /**
+     * Records an event into the calling thread's ring buffer, or drops it if the thread has not registered.
+     *
+     * @param event
+     * The event to record. The timestamp is filled in by this function.
+     */
+    static void record(TraceEvent event);
+
+    /**
+     * Writes every buffered event of a tree as Chrome trace JSON.
+     * This must only be called while no thread is recording events.
+     *
+     * @param treeId
+     * The tree to export events for.
+     *
+     * @param out
+     * The stream to write the JSON to.
+     */
+    static void dumpChromeJson(int treeId, std::ostream &out);
+
+    /**
+     * Creates a new id that identifies a tree's events.
+     *
+     * @return int
+     * A unique tree id.
+     */
+    static int newTreeId();
+};
+
+#endif /* _LFCATRACE_H */
@@ -13,9 +13,24 @@
 #include <thread>
 #include "bitset.h"
 
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#include <immintrin.h>
+#define MRLOCK_PAUSE() _mm_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+#define MRLOCK_PAUSE() __asm__ __volatile__("yield")
+#else
+#define MRLOCK_PAUSE()
+#endif
+
 //A bit of hack to initialize the bitset class
 template<typename BitsetType>
-inline void InitializeBitset(BitsetType& b, uint32_t r)
+inline void InitializeBitset(BitsetType&, uint32_t)
 {}
 
 template<>
@@ -24,18 +39,72 @@ inline void InitializeBitset<Bitset>(Bitset& b, uint32_t r)
     b.Resize(r);
 }
 
+//Waiting threads read the bits of a cell while its owner writes them. A 64-bit word
+//is accessed atomically, so that clearing it releases the critical section to the
+//thread that sees it cleared. A Bitset spans several words and is accessed directly
+template<typename BitsetType>
+inline void StoreBits(BitsetType& b, const BitsetType& value)
+{
+    b = value;
+}
+
+template<>
+inline void StoreBits<uint64_t>(uint64_t& b, const uint64_t& value)
+{
+    __atomic_store_n(&b, value, __ATOMIC_RELEASE);
+}
+
+//Sets every bit when flag is ~0, or clears every bit when flag is 0
+template<typename BitsetType>
+inline void FillBits(BitsetType& b, int flag)
+{
+    b = flag;
+}
+
+template<>
+inline void FillBits<uint64_t>(uint64_t& b, int flag)
+{
+    __atomic_store_n(&b, (uint64_t)(int64_t)flag, __ATOMIC_RELEASE);
+}
+
+template<typename BitsetType>
+inline bool AnyBits(const BitsetType& b)
+{
+    return b;
+}
+
+template<>
+inline bool AnyBits<uint64_t>(const uint64_t& b)
+{
+    return __atomic_load_n(&b, __ATOMIC_ACQUIRE) != 0;
+}
+
+template<typename BitsetType>
+inline bool Overlaps(const BitsetType& b, const BitsetType& resources)
+{
+    return b & resources;
+}
+
+template<>
+inline bool Overlaps<uint64_t>(const uint64_t& b, const uint64_t& resources)
+{
+    return (__atomic_load_n(&b, __ATOMIC_ACQUIRE) & resources) != 0;
+}
+
 template<typename BitsetType>
 class MRLock
 {
 public:
-    MRLock(uint32_t resources)
+    //The queue holds at least queueSize requests. By default it holds more than
+    //std::thread::hardware_concurrency() requests. Threads beyond the queue size
+    //back off until a slot is freed
+    MRLock(uint32_t resources, uint32_t queueSize = 0)
     {
         //We are using mask to wrap the index around cicular array,
         //so the buffer size should be the power of 2
-        //We set buffer size equal to or greater than the std::thread::hardware_concurrency()
-        uint32_t maxThreads = std::thread::hardware_concurrency(); 
+        uint32_t minSize = queueSize > 0 ? queueSize : std::thread::hardware_concurrency() + 1;
         uint32_t bufferSize = 2;
-        while(bufferSize <= maxThreads)
+        while(bufferSize < minSize)
         {
             bufferSize = bufferSize << 1;
         }
@@ -54,6 +123,9 @@ public:
             //This ensure that after a thread equeue a new request but before it set the m_bits to
             //proper value, the following request will not pass through
             m_buffer[i].m_bits = ~0;
+            m_buffer[i].m_shared.store(false, std::memory_order_relaxed);
+            m_buffer[i].m_released.store(0, std::memory_order_relaxed);
+            m_buffer[i].m_waiters.store(0, std::memory_order_relaxed);
         }
 
         m_head.store(0, std::memory_order_relaxed);
@@ -65,13 +137,17 @@ public:
         delete[] m_buffer;
     }
 
-    inline uint32_t Lock(const BitsetType& resources)
+    //Shared requests only exclude exclusive requests, so consecutive readers
+    //of overlapping resources pass each other
+    inline uint32_t Lock(const BitsetType& resources, bool shared = false)
     {
         //Enqueue the resource request at the tail
-        //If the queue is full, busy wait at the end
+        //If the queue is full, spin for a while and then park until the slot is dequeued,
+        //so that oversubscribed threads let the lock holders run
         //So the capacity of the queue actually determine the FIFO fairness
         Cell* cell;
         uint32_t pos;
+        uint32_t spins = 0;
 
         for(;;)
         {
@@ -87,23 +163,57 @@ public:
                     break;
                 }
             }
+            else if(dif < 0)
+            {
+                if(Backoff(&spins))
+                {
+                    cell->m_waiters.fetch_add(1);
+                    if(cell->m_sequence.load() == seq)
+                    {
+                        Park(&cell->m_sequence, seq);
+                    }
+                    cell->m_waiters.fetch_sub(1);
+                }
+            }
         }
 
-        cell->m_bits = resources;
+        //Both are published by the sequence
+        cell->m_shared.store(shared, std::memory_order_relaxed);
+        StoreBits(cell->m_bits, resources);
         cell->m_sequence.store(pos + 1, std::memory_order_release);
 
-        //Spin on all previsou locks 
+        //Spin on all previsou locks, parking when the holder takes long
         uint32_t spinPos = m_head;
+        spins = 0;
         while(spinPos != pos)
         {
             //We start from the head moving toward my pos, spin on cell that collide with my request
             //When that cell is freed we move on to the next one util reaching myself
-            //we need to check both m_sequence and m_bits, because either of them could be set to 
-            //indicate a free cell, and we want to move on quickly
-            if(pos - m_buffer[spinPos & m_bufferMask].m_sequence > m_bufferMask 
-                    || !(m_buffer[spinPos & m_bufferMask].m_bits & resources))
+            Cell* other = &m_buffer[spinPos & m_bufferMask];
+            //Read before checking the cell, so that a release after the check makes the park below return at once
+            uint32_t released = other->m_released.load(std::memory_order_acquire);
+
+            if(Passable(other, pos, resources, shared))
             {
                 spinPos++;
+                spins = 0;
+            }
+            else if(Backoff(&spins))
+            {
+                //Filling in a cell wakes nobody, so only park on cells that are already filled in
+                if(other->m_sequence.load(std::memory_order_acquire) == spinPos + 1)
+                {
+                    other->m_waiters.fetch_add(1);
+                    if(!Passable(other, pos, resources, shared))
+                    {
+                        Park(&other->m_released, released);
+                    }
+                    other->m_waiters.fetch_sub(1);
+                }
+                else
+                {
+                    std::this_thread::yield();
+                }
             }
         }
 
@@ -113,12 +223,19 @@ public:
 
     inline void Unlock(uint32_t handle)
     {
-        //Release my lock by setting the bits to 0
-        m_buffer[handle & m_bufferMask].m_bits = 0;
+        //Release my lock by setting the bits to 0, and wake the threads parked on it.
+        //Both releases publish the critical section to the threads that see them
+        Cell* mine = &m_buffer[handle & m_bufferMask];
+        FillBits(mine->m_bits, 0);
+        mine->m_released.fetch_add(1, std::memory_order_release);
+        if(mine->m_waiters.load())
+        {
+            Wake(&mine->m_released);
+        }
 
         //Dequeue cells that have been released
         uint32_t pos = m_head.load(std::memory_order_relaxed);
-        while(!m_buffer[pos & m_bufferMask].m_bits)
+        while(!AnyBits(m_buffer[pos & m_bufferMask].m_bits))
         {
             Cell* cell = &m_buffer[pos & m_bufferMask];    
             uint32_t seq = cell->m_sequence.load(std::memory_order_acquire);
@@ -126,10 +243,22 @@ public:
 
             if(dif == 0)
             {
-                if(m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                //Released, so that enqueuers which skip this cell by reading the new head see its critical section
+                if(m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_release, std::memory_order_relaxed))
                 {
-                    cell->m_bits = ~0;
-                    cell->m_sequence.store(pos + m_bufferMask + 1, std::memory_order_release);
+                    //A claimed cell looks exclusive until its owner fills it in
+                    FillBits(cell->m_bits, ~0);
+                    cell->m_shared.store(false, std::memory_order_relaxed);
+                    //Sequentially consistent, so that either this thread sees a parked enqueuer or it sees the new sequence
+                    cell->m_sequence.store(pos + m_bufferMask + 1);
+                    //Threads waiting for the previous request may have parked while the cell looked claimed,
+                    //so dequeuing counts as a release for them as well
+                    cell->m_released.fetch_add(1);
+                    if(cell->m_waiters.load())
+                    {
+                        Wake(&cell->m_sequence);
+                        Wake(&cell->m_released);
+                    }
                 }
             }
 
@@ -139,16 +268,72 @@ public:
 
 private:
     static const uint32_t CACHELINE_SIZE = 128;
+    static const uint32_t SPINS_BEFORE_YIELD = 128;
+    static const uint32_t SPINS_BEFORE_PARK = SPINS_BEFORE_YIELD + 16;
 
     struct Cell
     {
         std::atomic<uint32_t> m_sequence; 
         BitsetType m_bits;
+        std::atomic<bool> m_shared;
+        std::atomic<uint32_t> m_released;  //Incremented on every unlock, parked waiters sleep on it
+        std::atomic<uint32_t> m_waiters;   //Threads parked on m_sequence or m_released
         //Cells are allocated in contiguous memory, since m_bits and m_sequence value changed frequently
         //we'd better seperate each cell to increase cache hits, and this indeed provides significant speed up
-        char m_pad[CACHELINE_SIZE - sizeof(std::atomic<uint32_t>) - sizeof(uint64_t)];   
+        char m_pad[CACHELINE_SIZE - 3 * sizeof(std::atomic<uint32_t>) - sizeof(uint64_t) - sizeof(std::atomic<bool>)];   
     };
 
+    //We need to check both m_sequence and m_bits, because either of them could be set to 
+    //indicate a free cell, and we want to move on quickly
+    inline bool Passable(const Cell* other, uint32_t pos, const BitsetType& resources, bool shared) const
+    {
+        return pos - other->m_sequence.load(std::memory_order_acquire) > m_bufferMask
+                || !Overlaps(other->m_bits, resources)
+                || (shared && other->m_shared.load(std::memory_order_relaxed));
+    }
+
+    //Spins with a pause at first, then yields, and returns true once the caller should park
+    static inline bool Backoff(uint32_t* spins)
+    {
+        if(*spins >= SPINS_BEFORE_PARK)
+        {
+            *spins = 0;
+            return true;
+        }
+
+        if(*spins < SPINS_BEFORE_YIELD)
+        {
+            MRLOCK_PAUSE();
+        }
+        else
+        {
+            std::this_thread::yield();
+        }
+        (*spins)++;
+        return false;
+    }
+
+    //Sleeps while the word still holds the expected value. Without futexes, this only yields
+    static inline void Park(std::atomic<uint32_t>* word, uint32_t expected)
+    {
+#ifdef __linux__
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+#else
+        (void)word;
+        (void)expected;
+        std::this_thread::yield();
+#endif
+    }
+
+    static inline void Wake(std::atomic<uint32_t>* word)
+    {
+#ifdef __linux__
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE_PRIVATE, INT32_MAX, NULL, NULL, 0);
+#else
+        (void)word;
+#endif
+    }
+
     char m_pad0[CACHELINE_SIZE];
     Cell* m_buffer;
     uint32_t m_bufferMask;
@@ -1,24 +1,52 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
 #include <iostream>
+#include <limits>
+#include <memory>
 #include <random>
 #include <chrono>
+#include <sstream>
+#include <string>
 #include <thread>
 
 #include "lfca.h"
+#include "lfcabatcher.h"
 #include "mrlocktree.h"
 
-#define MAX_THREADS 32
-#define NUM_OPS 200000
+#ifdef __unix__
+#include <sys/utsname.h>
+#include <unistd.h>
+#endif
+
+// Set by CMake, which generates the version header at build time. Builds without it still run, but report unknown build metadata
+#ifdef LFCA_VERSION_HEADER
+#include "lfca_version.h"
+#endif
+#ifndef LFCA_COMMIT
+#define LFCA_COMMIT "unknown"
+#endif
+#ifndef LFCA_DIRTY
+#define LFCA_DIRTY "unknown"
+#endif
+#ifndef LFCA_BUILD_FLAGS
+#define LFCA_BUILD_FLAGS "unknown"
+#endif
+
+#define MAX_THREADS 32          // Default highest thread count
+#define NUM_OPS 200000          // Default operations per trial
+#define BATCH_THREADS 4         // Threads used to compare batch sizes
+#define BATCH_MAX_DELAY_US 100  // Maximum delay of a batch, in microseconds
+#define ELIMINATION_KEYS 64     // Keys used to compare elimination, few enough for inserts and removes of a value to meet
 
 // These values are all estimates, due to the nondeterministic nature of the program
-#define MAX_TREAPS_NEEDED (2 * NUM_OPS)
-#define MAX_NODES_NEEDED (32 * NUM_OPS)
-#define MAX_RESULT_SETS_NEEDED (2 * NUM_OPS)
-
-/**
- * The maximum number of threads that MRLock will support.
- * This is a hard-coded cap in the implementation that cannot be changed.
- */
-const int maxMrlockThreads = std::thread::hardware_concurrency();
+#define MAX_TREAPS_NEEDED(ops) (2 * (ops) + MRLOCK_STRIPES)  // MrlockTree allocates a treap per stripe up front
+#define MAX_NODES_NEEDED(ops) (32 * (ops))
+#define MAX_RESULT_SETS_NEEDED(ops) (2 * (ops))
 
 using namespace std;
 using namespace std::chrono;
@@ -46,8 +74,42 @@ struct OpWeights {
     }
 };
 
+/**
+ * The benchmark configuration, as given on the command line.
+ */
+struct Options {
+    vector<string> trees {"LFCA", "LFCA-MVCC", "LFCA-ELIM", "LFCA-FC", "MRLOCK", "MRLOCK-OPT"};
+    vector<OpWeights> mixes;
+    int minKey {numeric_limits<int>::min()};
+    int maxKey {numeric_limits<int>::max()};
+    int numOps {NUM_OPS};          // Operations per trial, or the most operations per trial when running for a duration
+    int durationMs {0};            // Time limit of each trial. 0 runs every operation
+    vector<int> threads;
+    int rangeQuerySize {-1};       // Overrides the range query size of every mix when not negative
+    int reps {1};                  // Measured trials per configuration
+    int warmup {0};                // Unmeasured trials before the measured ones
+    bool extras {false};           // Also compare batch sizes, batched lookups and elimination on few keys
+    string format {"text"};        // text, csv or json
+    string output;                 // File the csv or json records are written to. Empty writes them to stdout
+};
+
+static const char *usage =
+    "Usage: lfca [options]\n"
+    "Without options, every tree runs the standard mixes on 1 to 32 threads, followed by the batching, lookupBatch and elimination comparisons.\n"
+    "  --trees=LIST        Trees to run: lfca, lfca-mvcc, lfca-elim, lfca-fc, mrlock, mrlock-opt or all (default: all)\n"
+    "  --mix=I,R,L,Q[,S]   Weights of inserts, removes, lookups and range queries, and the range query size. Repeat for several mixes (default: the standard mixes)\n"
+    "  --range-size=N      Keys covered by each range query, overriding the mixes\n"
+    "  --keys=LOW,HIGH     Range of the random keys (default: all integers)\n"
+    "  --ops=N             Operations per trial, split over the threads, at least one each (default: 200000)\n"
+    "  --duration=MS       Stop each trial after this many milliseconds. --ops is then the most operations per trial\n"
+    "  --threads=LIST      Thread counts, such as 1,2,4 or 1-32 (default: 1-32)\n"
+    "  --reps=N            Measured trials per configuration (default: 1)\n"
+    "  --warmup=N          Unmeasured trials before the measured ones (default: 0)\n"
+    "  --extras            Also compare batch sizes, batched lookups and elimination on few keys\n"
+    "  --format=FORMAT     text, or csv or json to write a record per measured trial with the host and build metadata (default: text)\n"
+    "  --output=FILE       Write the csv or json records to a file instead of stdout\n";
+
 static mt19937 randEngine {(unsigned int)time(NULL)};
-static uniform_int_distribution<int> valDist {numeric_limits<int>::min(), numeric_limits<int>::max()};
 
 Operation getRandOp(discrete_distribution<int> opDist) {
     int randNum = opDist(randEngine);
@@ -62,12 +124,13 @@ struct RandomOpVals {
     vector<int> rangeQueryMaxVals;
     vector<int> randomOps;
 
-    RandomOpVals(int numOps, OpWeights weights) {
+    RandomOpVals(int numOps, OpWeights weights, int minKey = numeric_limits<int>::min(), int maxKey = numeric_limits<int>::max()) {
         // Create distribution of operations
         discrete_distribution<int> opDist {weights.insertWeight, weights.removeWeight, weights.lookupWeight, weights.rangeQueryWeight};
 
-        // Create range query distribution based on the range query size. This ensures the range never exceeds the max integer value
-        uniform_int_distribution<int> rqDist {numeric_limits<int>::min(), numeric_limits<int>::max() - weights.rangeQuerySize};
+        // Create range query distribution based on the range query size. This ensures the range never exceeds the maximum key
+        uniform_int_distribution<int> valDist {minKey, maxKey};
+        uniform_int_distribution<int> rqDist {minKey, (int)max((long long)minKey, (long long)maxKey - weights.rangeQuerySize)};
 
         // Pre-allocate space
         randomOps.reserve(numOps);
@@ -84,7 +147,7 @@ struct RandomOpVals {
             int rangeQueryMin = rqDist(randEngine);
 
             rangeQueryMinVals.push_back(rangeQueryMin);
-            rangeQueryMaxVals.push_back(rangeQueryMin + weights.rangeQuerySize);
+            rangeQueryMaxVals.push_back((int)min((long long)rangeQueryMin + weights.rangeQuerySize, (long long)maxKey));
 
             // Generate random op
             randomOps.push_back(opDist(randEngine));
@@ -98,19 +161,26 @@ struct RandomOpVals {
     }
 };
 
-static void mixedThread(SearchTree *tree, int numOps, RandomOpVals *randomOpVals) {
+static void mixedThread(SearchTree *tree, int numOps, RandomOpVals *randomOpVals, int *unchangedUpdates, atomic<bool> *stop, int *completed, atomic<int> *finished) {
     try {
+        // Counted locally and stored once, since the counters of the threads share cache lines
+        int unchanged = 0;
         int op;
-        for (int i = 0; i < numOps; i++) {
+        int i;
+        for (i = 0; i < numOps && !stop->load(memory_order_relaxed); i++) {
             op = randomOpVals->randomOps.at(i);
 
             switch(op) {
                 case INSERT:
-                    tree->insert(randomOpVals->insertVals.at(i));
+                    if (!tree->insert(randomOpVals->insertVals.at(i))) {
+                        unchanged++;
+                    }
                     break;
 
                 case REMOVE:
-                    tree->remove(randomOpVals->removeVals.at(i));
+                    if (!tree->remove(randomOpVals->removeVals.at(i))) {
+                        unchanged++;
+                    }
                     break;
 
                 case LOOKUP:
@@ -122,96 +192,686 @@ static void mixedThread(SearchTree *tree, int numOps, RandomOpVals *randomOpVals
                     break;
             }
         }
+
+        *unchangedUpdates = unchanged;
+        *completed = i;
+        finished->fetch_add(1);
     }
     catch (out_of_range e) {
-        cout << endl << e.what() << endl;
-        cout << "If this is a preallocation error, try running the program again.";
+        // stdout may hold the csv or json records
+        cerr << endl << e.what() << endl;
+        cerr << "If this is a preallocation error, try running the program again." << endl;
         exit(-1);
     }
 }
 
-static double RunPerformanceTest(SearchTree *tree, OpWeights weights, int numThreads) {
+// The outcome of running one tree once
+struct Trial {
+    double ms;             // Time taken
+    long long ops;         // Operations completed
+    int unchangedUpdates;  // Inserts and removes that did not change the tree. These do not copy a treap
+    int treaps;            // Treaps allocated
+    int nodes;             // LFCA nodes allocated, or -1 for trees that do not use the node pool
+    int resultSets;        // LFCA result sets allocated, or -1 for trees that do not use the result set pool
+};
+
+/**
+ * Runs random operations on a tree and times them.
+ *
+ * @param durationMs
+ * The time after which the threads stop, or 0 to run every operation.
+ */
+static Trial RunPerformanceTest(SearchTree *tree, OpWeights weights, int numThreads, int numOps, int durationMs, int minKey, int maxKey) {
     vector<thread> threads;
+    vector<int> threadUnchangedUpdates(numThreads, 0);
+    vector<int> threadCompleted(numThreads, 0);
+    atomic<bool> stop {false};
+    atomic<int> finished {0};
 
-    int opsPerThread = NUM_OPS / numThreads;
+    int opsPerThread = numOps / numThreads;
 
     vector<RandomOpVals> threadRandomOpVals;
     for (int i = 0; i < numThreads; i++) {
-        threadRandomOpVals.push_back(RandomOpVals(opsPerThread, weights));
+        threadRandomOpVals.push_back(RandomOpVals(opsPerThread, weights, minKey, maxKey));
     }
 
     high_resolution_clock::time_point start = high_resolution_clock::now();
 
     for (int i = 0; i < numThreads; i++) {
-        threads.push_back(thread(mixedThread, tree, opsPerThread, &threadRandomOpVals.at(i)));
+        threads.push_back(thread(mixedThread, tree, opsPerThread, &threadRandomOpVals.at(i), &threadUnchangedUpdates.at(i), &stop, &threadCompleted.at(i), &finished));
+    }
+
+    // Stop the threads once the duration is over, unless they run out of operations first
+    if (durationMs > 0) {
+        high_resolution_clock::time_point deadline = start + milliseconds(durationMs);
+        while (high_resolution_clock::now() < deadline && finished.load() < numThreads) {
+            this_thread::sleep_for(milliseconds(1));
+        }
+        stop.store(true);
     }
 
+    Trial trial {0, 0, 0, 0, -1, -1};
     for (int i = 0; i < numThreads; i++) {
         threads.at(i).join();
+        trial.unchangedUpdates += threadUnchangedUpdates.at(i);
+        trial.ops += threadCompleted.at(i);
     }
 
     // Calculate the total time taken
     high_resolution_clock::time_point end = high_resolution_clock::now();
     duration<double, milli> elapsed = end - start;
+    trial.ms = elapsed.count();
 
-    return elapsed.count();
+    return trial;
 }
 
-int main(void) {
-    // Set up test weights
-    vector<OpWeights> opWeights;
-    opWeights.push_back(OpWeights(0.25, 0.25, 0.50, 0.00, 0));  // w:50% r:50%
-    opWeights.push_back(OpWeights(0.10, 0.10, 0.80, 0.00, 0));  // w:20% r:80%
-    opWeights.push_back(OpWeights(0.005, 0.005, 0.99, 0.00, 0));  // w:1% r:99%
-    opWeights.push_back(OpWeights(0.10, 0.10, 0.55, 0.25, 10));  // w:20% r:55% q:25%-10
-    opWeights.push_back(OpWeights(0.10, 0.10, 0.55, 0.25, 1000));  // w:20% r:55% q:25%-1000
-    opWeights.push_back(OpWeights(0.10, 0.10, 0.55, 0.25, 100000));  // w:20% r:55% q:25%-100000
-
-    for (OpWeights weights : opWeights) {
-        double lfcaResults[MAX_THREADS];
-        double mrlockResults[maxMrlockThreads];
-
-        cout << "Running " << NUM_OPS << " random operations total on 1 to " << MAX_THREADS << " threads. Weights: (insert: "
-            << weights.insertWeight << ", remove: " << weights.removeWeight << ", lookup: " << weights.lookupWeight << ", range query: " << weights.rangeQueryWeight << " (Size " << weights.rangeQuerySize << "))..." << endl;
+/**
+ * Preallocates the pools of a tree, creates and runs it, and frees the pools again.
+ *
+ * @param name
+ * The tree to run, as listed in the usage.
+ */
+static Trial RunTree(const string &name, OpWeights weights, int numThreads, const Options &options) {
+    bool lfca = name.compare(0, 4, "LFCA") == 0;
 
-        for (int iThread = 1; iThread <= MAX_THREADS; iThread++) {
-            cout << "Running with " << iThread << " thread(s)..." << flush;
+    Treap::Preallocate(MAX_TREAPS_NEEDED(options.numOps));
+    if (lfca) {
+        node::Preallocate(MAX_NODES_NEEDED(options.numOps));
+        rs::Preallocate(MAX_RESULT_SETS_NEEDED(options.numOps));
+    }
 
-            Treap::Preallocate(MAX_TREAPS_NEEDED);
-            node::Preallocate(MAX_NODES_NEEDED);
-            rs::Preallocate(MAX_RESULT_SETS_NEEDED);
+    unique_ptr<SearchTree> tree;
+    if (name == "LFCA") {
+        tree.reset(new LfcaTree());
+    }
+    else if (name == "LFCA-MVCC") {
+        tree.reset(new LfcaTree(true));
+    }
+    else if (name == "LFCA-ELIM") {
+        LfcaTree *lfcaTree = new LfcaTree();
+        lfcaTree->setElimination(true);
+        tree.reset(lfcaTree);
+    }
+    else if (name == "LFCA-FC") {
+        LfcaTree *lfcaTree = new LfcaTree();
+        lfcaTree->setCombining(true);
+        tree.reset(lfcaTree);
+    }
+    else if (name == "MRLOCK") {
+        // The default lock queue is smaller than the thread count on most machines, so this also covers oversubscription
+        tree.reset(new MrlockTree());
+    }
+    else {
+        MrlockTree *mrlockTree = new MrlockTree();
+        mrlockTree->setOptimisticReads(true);
+        tree.reset(mrlockTree);
+    }
+
+    Trial trial = RunPerformanceTest(tree.get(), weights, numThreads, options.numOps, options.durationMs, options.minKey, options.maxKey);
+    trial.treaps = Treap::NumAllocated();
+    if (lfca) {
+        trial.nodes = node::NumAllocated();
+        trial.resultSets = rs::NumAllocated();
+    }
 
-            LfcaTree lfcaTree;
-            lfcaResults[iThread-1] = RunPerformanceTest(&lfcaTree, weights, iThread);
+    tree.reset();
+    Treap::Deallocate();
+    if (lfca) {
+        node::Deallocate();
+        rs::Deallocate();
+    }
+
+    return trial;
+}
 
-            Treap::Deallocate();
-            node::Deallocate();
-            rs::Deallocate();
+// Mean, sample standard deviation and the half-width of the 95% confidence interval of some measurements
+struct Summary {
+    double mean {0};
+    double stddev {0};
+    double ci95 {0};
 
-            // MRLock is internally capped with the number of threads it will allow. Don't exceed this limit, as it causes crashes/hangs
-            if (iThread <= maxMrlockThreads) {
-                Treap::Preallocate(MAX_TREAPS_NEEDED);
+    Summary(const vector<double> &values) {
+        // Two-sided Student's t critical values for 1 to 30 degrees of freedom
+        static const double t95[] = {12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228, 2.201, 2.179, 2.160, 2.145, 2.131,
+                                     2.120, 2.110, 2.101, 2.093, 2.086, 2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042};
 
-                MrlockTree mrlockTree;
-                mrlockResults[iThread-1] = RunPerformanceTest(&mrlockTree, weights, iThread);
+        size_t n = values.size();
+        for (double v : values) {
+            mean += v / n;
+        }
+        if (n < 2) {
+            return;
+        }
 
-                Treap::Deallocate();
+        double squares = 0;
+        for (double v : values) {
+            squares += (v - mean) * (v - mean);
+        }
+        stddev = sqrt(squares / (n - 1));
+        ci95 = (n - 1 <= 30 ? t95[n - 2] : 1.960) * stddev / sqrt((double)n);
+    }
+};
+
+// The machine and build that the results were measured on
+struct Host {
+    string name {"unknown"};
+    string os {"unknown"};
+    string cpu {"unknown"};
+    string cpuMhz {"unknown"};    // Current frequency of the first CPU, as reported by the kernel
+    string governor {"unknown"};  // Frequency scaling governor of the first CPU
+    unsigned int hardwareThreads {thread::hardware_concurrency()};
+    string compiler;
+    string flags {LFCA_BUILD_FLAGS};
+    string commit {LFCA_COMMIT};
+    string dirty {LFCA_DIRTY};    // Whether the work tree had uncommitted changes: yes, no or unknown
+    string timestamp;             // Start of the run, in UTC
+
+    Host() {
+#if defined(__clang__)
+        compiler = __VERSION__;
+#elif defined(__GNUC__)
+        compiler = string("g++ ") + __VERSION__;
+#else
+        compiler = "unknown";
+#endif
+
+#ifdef __unix__
+        char hostName[256];
+        if (gethostname(hostName, sizeof(hostName)) == 0) {
+            hostName[sizeof(hostName) - 1] = '\0';
+            name = hostName;
+        }
+
+        struct utsname system;
+        if (uname(&system) == 0) {
+            os = string(system.sysname) + " " + system.release + " " + system.machine;
+        }
+#endif
+
+        // Linux only. Elsewhere these stay unknown
+        ifstream cpuInfo("/proc/cpuinfo");
+        string line;
+        while (getline(cpuInfo, line)) {
+            size_t colon = line.find(':');
+            if (colon == string::npos || colon + 2 > line.size()) {
+                continue;
             }
+            string key = line.substr(0, line.find_last_not_of(" \t", colon - 1) + 1);
+            if (key == "model name" && cpu == "unknown") {
+                cpu = line.substr(colon + 2);
+            }
+            else if (key == "cpu MHz" && cpuMhz == "unknown") {
+                cpuMhz = line.substr(colon + 2);
+            }
+        }
 
-            cout << "\r";
+        ifstream governorFile("/sys/devices/system/cpu/cpu0/cpufreq/scaling_governor");
+        getline(governorFile, governor);
+        if (governor.empty()) {
+            governor = "unknown";
         }
 
-        cout << endl;
-        cout << "Results (in ms):" << endl;
-        cout << "LFCA, ";
-        for (int iThread = 0; iThread < MAX_THREADS; iThread++) {
-            cout << to_string(lfcaResults[iThread]) << (iThread < MAX_THREADS - 1 ? ", " : "");
+        char time[32];
+        time_t now = std::time(NULL);
+        strftime(time, sizeof(time), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+        timestamp = time;
+    }
+};
+
+static string JsonString(const string &text) {
+    string json = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            json += '\\';
+            json += c;
+        }
+        else if ((unsigned char)c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            json += escaped;
+        }
+        else {
+            json += c;
+        }
+    }
+    return json + "\"";
+}
+
+/**
+ * Writes a record per measured trial as csv or json, together with the host and build metadata.
+ *
+ * In csv, the metadata are written first as comment lines starting with #, followed by a header row.
+ * In json, the output is one object with a "host" object, an "options" object and a "runs" array.
+ */
+class Report {
+private:
+    ostream &out;
+    bool json;
+    bool firstRecord {true};
+
+    // Pool counters are empty or null for trees that do not use the pool
+    string Count(int count) {
+        return count >= 0 ? to_string(count) : (json ? "null" : "");
+    }
+
+public:
+    Report(ostream &out, const string &format, const Host &host, const Options &options) : out(out), json(format == "json") {
+        if (json) {
+            out << "{" << endl;
+            out << "  \"host\": {\"name\": " << JsonString(host.name) << ", \"os\": " << JsonString(host.os) << ", \"cpu\": " << JsonString(host.cpu)
+                << ", \"cpuMhz\": " << JsonString(host.cpuMhz) << ", \"governor\": " << JsonString(host.governor) << ", \"hardwareThreads\": " << host.hardwareThreads
+                << ", \"compiler\": " << JsonString(host.compiler) << ", \"flags\": " << JsonString(host.flags) << ", \"commit\": " << JsonString(host.commit)
+                << ", \"dirty\": " << JsonString(host.dirty) << ", \"timestamp\": " << JsonString(host.timestamp) << "}," << endl;
+            out << "  \"options\": {\"ops\": " << options.numOps << ", \"durationMs\": " << options.durationMs << ", \"minKey\": " << options.minKey
+                << ", \"maxKey\": " << options.maxKey << ", \"reps\": " << options.reps << ", \"warmup\": " << options.warmup << "}," << endl;
+            out << "  \"runs\": [";
+        }
+        else {
+            out << "# host: " << host.name << endl;
+            out << "# os: " << host.os << endl;
+            out << "# cpu: " << host.cpu << endl;
+            out << "# cpu MHz: " << host.cpuMhz << endl;
+            out << "# governor: " << host.governor << endl;
+            out << "# hardware threads: " << host.hardwareThreads << endl;
+            out << "# compiler: " << host.compiler << endl;
+            out << "# flags: " << host.flags << endl;
+            out << "# commit: " << host.commit << endl;
+            out << "# dirty: " << host.dirty << endl;
+            out << "# timestamp: " << host.timestamp << endl;
+            out << "# ops: " << options.numOps << ", duration ms: " << options.durationMs << ", keys: [" << options.minKey << ", " << options.maxKey << "], reps: "
+                << options.reps << ", warmup: " << options.warmup << endl;
+            out << "tree,insert,remove,lookup,range_query,range_query_size,threads,rep,ops,elapsed_ms,mops_per_s,treaps,nodes,result_sets,unchanged_updates" << endl;
+        }
+    }
+
+    ~Report() {
+        if (json) {
+            out << endl << "  ]" << endl << "}" << endl;
+        }
+    }
+
+    void Record(const string &tree, OpWeights weights, int numThreads, int rep, const Trial &trial) {
+        double throughput = trial.ops / trial.ms / 1000;
+
+        if (json) {
+            out << (firstRecord ? "" : ",") << endl;
+            out << "    {\"tree\": " << JsonString(tree) << ", \"mix\": {\"insert\": " << weights.insertWeight << ", \"remove\": " << weights.removeWeight
+                << ", \"lookup\": " << weights.lookupWeight << ", \"rangeQuery\": " << weights.rangeQueryWeight << ", \"rangeQuerySize\": " << weights.rangeQuerySize
+                << "}, \"threads\": " << numThreads << ", \"rep\": " << rep << ", \"ops\": " << trial.ops << ", \"elapsedMs\": " << to_string(trial.ms)
+                << ", \"mopsPerS\": " << to_string(throughput) << ", \"treaps\": " << trial.treaps << ", \"nodes\": " << Count(trial.nodes)
+                << ", \"resultSets\": " << Count(trial.resultSets) << ", \"unchangedUpdates\": " << trial.unchangedUpdates << "}";
+        }
+        else {
+            out << tree << "," << weights.insertWeight << "," << weights.removeWeight << "," << weights.lookupWeight << "," << weights.rangeQueryWeight << ","
+                << weights.rangeQuerySize << "," << numThreads << "," << rep << "," << trial.ops << "," << to_string(trial.ms) << "," << to_string(throughput) << ","
+                << trial.treaps << "," << Count(trial.nodes) << "," << Count(trial.resultSets) << "," << trial.unchangedUpdates << endl;
+        }
+        firstRecord = false;
+    }
+};
+
+static void batchedThread(LfcaTree *tree, int numOps, RandomOpVals *randomOpVals, size_t batchSize, vector<double> *latencies) {
+    LfcaBatcher batcher(tree, batchSize, microseconds(BATCH_MAX_DELAY_US));
+    vector<steady_clock::time_point> submitted;
+
+    for (int i = 0; i <= numOps; i++) {
+        if (i < numOps) {
+            submitted.push_back(steady_clock::now());
+
+            if (randomOpVals->randomOps.at(i) == INSERT) {
+                batcher.insertAsync(randomOpVals->insertVals.at(i));
+            }
+            else {
+                batcher.removeAsync(randomOpVals->removeVals.at(i));
+            }
+        }
+        else {
+            batcher.flush();
         }
-        cout << endl;
-        cout << "MRLOCK, ";
-        for (int iThread = 0; iThread < maxMrlockThreads; iThread++) {
-            cout << to_string(mrlockResults[iThread]) << (iThread < maxMrlockThreads - 1 ? ", " : "");
+
+        // Every update added so far completes when the batch is applied
+        if (batcher.pending() == 0) {
+            steady_clock::time_point now = steady_clock::now();
+            for (steady_clock::time_point t : submitted) {
+                latencies->push_back(duration<double, micro>(now - t).count());
+            }
+            submitted.clear();
         }
-        cout << endl << endl;
+    }
+}
+
+/**
+ * Runs random inserts and removes through per-thread batchers and times them.
+ *
+ * @param latencies
+ * The location to store the time from adding each update to applying its batch, in microseconds, sorted.
+ */
+static double RunBatchingTest(size_t batchSize, int numThreads, int numOps, vector<double> *latencies) {
+    LfcaTree tree;
+    int numOpsPerThread = numOps / numThreads;
+
+    vector<RandomOpVals> randomOpVals;
+    for (int i = 0; i < numThreads; i++) {
+        randomOpVals.push_back(RandomOpVals(numOpsPerThread, OpWeights(0.50, 0.50, 0.00, 0.00, 0)));
+    }
+
+    vector<vector<double>> threadLatencies(numThreads);
+    vector<thread> threads;
+    high_resolution_clock::time_point start = high_resolution_clock::now();
+
+    for (int i = 0; i < numThreads; i++) {
+        threads.push_back(thread(batchedThread, &tree, numOpsPerThread, &randomOpVals.at(i), batchSize, &threadLatencies.at(i)));
+    }
+
+    for (int i = 0; i < numThreads; i++) {
+        threads.at(i).join();
+    }
+
+    high_resolution_clock::time_point end = high_resolution_clock::now();
+    duration<double, milli> elapsed = end - start;
+
+    latencies->clear();
+    for (vector<double> &l : threadLatencies) {
+        latencies->insert(latencies->end(), l.begin(), l.end());
+    }
+    sort(latencies->begin(), latencies->end());
+
+    return elapsed.count();
+}
+
+/**
+ * Parses a list of numbers and ranges, such as 1,2,4 or 1-8,16.
+ */
+static bool ParseThreads(const string &text, vector<int> *threads) {
+    stringstream list(text);
+    string item;
+    while (getline(list, item, ',')) {
+        size_t dash = item.find('-');
+        int first = atoi(item.substr(0, dash).c_str());
+        int last = dash == string::npos ? first : atoi(item.substr(dash + 1).c_str());
+        if (first < 1 || last < first) {
+            return false;
+        }
+        for (int i = first; i <= last; i++) {
+            threads->push_back(i);
+        }
+    }
+    return !threads->empty();
+}
+
+static bool ParseMix(const string &text, vector<OpWeights> *mixes) {
+    double w[4];
+    int rangeQuerySize = 0;
+    if (sscanf(text.c_str(), "%lf,%lf,%lf,%lf,%d", &w[0], &w[1], &w[2], &w[3], &rangeQuerySize) < 4) {
+        return false;
+    }
+    mixes->push_back(OpWeights(w[0], w[1], w[2], w[3], rangeQuerySize));
+    return true;
+}
+
+static bool ParseTrees(const string &text, vector<string> *trees) {
+    static const vector<string> names {"LFCA", "LFCA-MVCC", "LFCA-ELIM", "LFCA-FC", "MRLOCK", "MRLOCK-OPT"};
+
+    stringstream list(text);
+    string item;
+    trees->clear();
+    while (getline(list, item, ',')) {
+        transform(item.begin(), item.end(), item.begin(), ::toupper);
+        if (item == "ALL") {
+            trees->insert(trees->end(), names.begin(), names.end());
+        }
+        else if (find(names.begin(), names.end(), item) != names.end()) {
+            trees->push_back(item);
+        }
+        else {
+            return false;
+        }
+    }
+    return !trees->empty();
+}
+
+/**
+ * Reads the options from the command line.
+ *
+ * @return bool
+ * False if an option is unknown or malformed.
+ */
+static bool ParseOptions(int argc, char **argv, Options *options) {
+    // Without options, run the full comparison
+    options->extras = argc == 1;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        size_t equals = arg.find('=');
+        string name = arg.substr(0, equals);
+        string value = equals == string::npos ? "" : arg.substr(equals + 1);
+        bool ok = true;
+
+        if (name == "--trees") {
+            ok = ParseTrees(value, &options->trees);
+        }
+        else if (name == "--mix") {
+            ok = ParseMix(value, &options->mixes);
+        }
+        else if (name == "--range-size") {
+            options->rangeQuerySize = atoi(value.c_str());
+            ok = options->rangeQuerySize >= 0;
+        }
+        else if (name == "--keys") {
+            ok = sscanf(value.c_str(), "%d,%d", &options->minKey, &options->maxKey) == 2 && options->minKey <= options->maxKey;
+        }
+        else if (name == "--ops") {
+            options->numOps = atoi(value.c_str());
+            ok = options->numOps > 0;
+        }
+        else if (name == "--duration") {
+            options->durationMs = atoi(value.c_str());
+            ok = options->durationMs > 0;
+        }
+        else if (name == "--threads") {
+            options->threads.clear();
+            ok = ParseThreads(value, &options->threads);
+        }
+        else if (name == "--reps") {
+            options->reps = atoi(value.c_str());
+            ok = options->reps > 0;
+        }
+        else if (name == "--warmup") {
+            options->warmup = atoi(value.c_str());
+            ok = options->warmup >= 0;
+        }
+        else if (name == "--extras") {
+            options->extras = true;
+        }
+        else if (name == "--format") {
+            options->format = value;
+            ok = value == "text" || value == "csv" || value == "json";
+        }
+        else if (name == "--output") {
+            options->output = value;
+            ok = !value.empty();
+        }
+        else {
+            ok = false;
+        }
+
+        if (!ok) {
+            cerr << "Invalid option: " << arg << endl;
+            return false;
+        }
+    }
+
+    if (!options->output.empty() && options->format == "text") {
+        cerr << "--output needs --format=csv or --format=json" << endl;
+        return false;
+    }
+
+    if (options->mixes.empty()) {
+        options->mixes.push_back(OpWeights(0.25, 0.25, 0.50, 0.00, 0));  // w:50% r:50%
+        options->mixes.push_back(OpWeights(0.10, 0.10, 0.80, 0.00, 0));  // w:20% r:80%
+        options->mixes.push_back(OpWeights(0.005, 0.005, 0.99, 0.00, 0));  // w:1% r:99%
+        options->mixes.push_back(OpWeights(0.10, 0.10, 0.55, 0.25, 10));  // w:20% r:55% q:25%-10
+        options->mixes.push_back(OpWeights(0.10, 0.10, 0.55, 0.25, 1000));  // w:20% r:55% q:25%-1000
+        options->mixes.push_back(OpWeights(0.10, 0.10, 0.55, 0.25, 100000));  // w:20% r:55% q:25%-100000
+    }
+    if (options->rangeQuerySize >= 0) {
+        for (OpWeights &weights : options->mixes) {
+            weights.rangeQuerySize = options->rangeQuerySize;
+        }
+    }
+    if (options->threads.empty()) {
+        for (int i = 1; i <= MAX_THREADS; i++) {
+            options->threads.push_back(i);
+        }
+    }
+
+    // Every thread needs at least one operation
+    int maxThreads = *max_element(options->threads.begin(), options->threads.end());
+    if (options->extras) {
+        maxThreads = max(maxThreads, BATCH_THREADS);
+    }
+    if (options->numOps < maxThreads) {
+        cerr << "--ops must be at least the highest thread count, " << maxThreads << endl;
+        return false;
+    }
+
+    return true;
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    if (argc == 2 && (string(argv[1]) == "--help" || string(argv[1]) == "-h")) {
+        cout << usage;
+        return 0;
+    }
+    if (!ParseOptions(argc, argv, &options)) {
+        cerr << usage;
+        return 1;
+    }
+
+    // With csv or json records, the readable results go to stderr so stdout only holds the records
+    ostream &text = options.format == "text" ? cout : cerr;
+    ofstream outputFile;
+    if (!options.output.empty()) {
+        outputFile.open(options.output);
+        if (!outputFile) {
+            cerr << "Cannot open " << options.output << endl;
+            return 1;
+        }
+    }
+    unique_ptr<Report> report;
+    if (options.format != "text") {
+        report.reset(new Report(options.output.empty() ? cout : outputFile, options.format, Host(), options));
+    }
+
+    for (OpWeights weights : options.mixes) {
+        text << "Running " << (options.durationMs > 0 ? "at most " : "") << options.numOps << " random operations total on " << options.threads.front() << " to " << options.threads.back() << " threads";
+        if (options.durationMs > 0) {
+            text << " for " << options.durationMs << " ms";
+        }
+        text << ", " << options.warmup << " warmup and " << options.reps << " measured trial(s). Keys: [" << options.minKey << ", " << options.maxKey << "]. Weights: (insert: "
+            << weights.insertWeight << ", remove: " << weights.removeWeight << ", lookup: " << weights.lookupWeight << ", range query: " << weights.rangeQueryWeight << " (Size " << weights.rangeQuerySize << "))..." << endl;
+        text << "Results (tree, threads, mean ms, stddev ms, 95% CI ms, mean Mops/s, stddev Mops/s, 95% CI Mops/s, mean treaps allocated, mean unchanged updates):" << endl;
+
+        for (const string &treeName : options.trees) {
+            for (int numThreads : options.threads) {
+                cerr << "Running " << treeName << " with " << numThreads << " thread(s)...\r" << flush;
+
+                for (int i = 0; i < options.warmup; i++) {
+                    RunTree(treeName, weights, numThreads, options);
+                }
+
+                vector<double> times;
+                vector<double> throughputs;
+                double treaps = 0;
+                double unchangedUpdates = 0;
+                for (int i = 0; i < options.reps; i++) {
+                    Trial trial = RunTree(treeName, weights, numThreads, options);
+                    if (report) {
+                        report->Record(treeName, weights, numThreads, i, trial);
+                    }
+                    times.push_back(trial.ms);
+                    throughputs.push_back(trial.ops / trial.ms / 1000);
+                    treaps += (double)trial.treaps / options.reps;
+                    unchangedUpdates += (double)trial.unchangedUpdates / options.reps;
+                }
+
+                cerr << string(60, ' ') << "\r" << flush;
+
+                Summary time(times);
+                Summary throughput(throughputs);
+                text << treeName << ", " << numThreads << ", " << to_string(time.mean) << ", " << to_string(time.stddev) << ", " << to_string(time.ci95)
+                    << ", " << to_string(throughput.mean) << ", " << to_string(throughput.stddev) << ", " << to_string(throughput.ci95)
+                    << ", " << (long long)treaps << ", " << (long long)unchangedUpdates << endl;
+            }
+        }
+        text << endl;
+    }
+
+    if (!options.extras) {
+        return 0;
+    }
+
+    // Compare batch sizes of the asynchronous front-end
+    vector<size_t> batchSizes {1, 8, 64, 512};
+
+    text << "Running " << options.numOps << " random inserts and removes total through batchers on " << BATCH_THREADS << " threads. Maximum delay: " << BATCH_MAX_DELAY_US << " us..." << endl;
+    text << "Results (batch size, time in ms, p50 latency in us, p99 latency in us):" << endl;
+    for (size_t batchSize : batchSizes) {
+        Treap::Preallocate(MAX_TREAPS_NEEDED(options.numOps));
+        node::Preallocate(MAX_NODES_NEEDED(options.numOps));
+
+        vector<double> latencies;
+        double elapsed = RunBatchingTest(batchSize, BATCH_THREADS, options.numOps, &latencies);
+
+        Treap::Deallocate();
+        node::Deallocate();
+
+        text << batchSize << ", " << to_string(elapsed) << ", " << to_string(latencies.at(latencies.size() / 2)) << ", " << to_string(latencies.at(latencies.size() * 99 / 100)) << endl;
+    }
+
+    // Compare single and batched lookups
+    text << endl << "Running " << options.numOps << " lookups on a tree of " << options.numOps << " random values, one at a time and batched..." << endl;
+    {
+        Treap::Preallocate(MAX_TREAPS_NEEDED(options.numOps));
+        node::Preallocate(MAX_NODES_NEEDED(options.numOps));
+
+        LfcaTree tree;
+        RandomOpVals randomOpVals(options.numOps, OpWeights(1.00, 0.00, 0.00, 0.00, 0));
+        for (int val : randomOpVals.insertVals) {
+            tree.insert(val);
+        }
+
+        unique_ptr<bool[]> found(new bool[options.numOps]);
+
+        high_resolution_clock::time_point start = high_resolution_clock::now();
+        for (int i = 0; i < options.numOps; i++) {
+            found[i] = tree.lookup(randomOpVals.lookupVals.at(i));
+        }
+        duration<double, milli> single = high_resolution_clock::now() - start;
+
+        start = high_resolution_clock::now();
+        tree.lookupBatch(randomOpVals.lookupVals.data(), found.get(), options.numOps);
+        duration<double, milli> batched = high_resolution_clock::now() - start;
+
+        Treap::Deallocate();
+        node::Deallocate();
+
+        text << "Results (in ms):" << endl;
+        text << "lookup, " << to_string(single.count()) << endl;
+        text << "lookupBatch, " << to_string(batched.count()) << endl;
+    }
+
+    // Compare updates with and without elimination on few keys, where contended inserts and removes of the same value meet
+    Options fewKeys = options;
+    fewKeys.minKey = 0;
+    fewKeys.maxKey = ELIMINATION_KEYS - 1;
+    int eliminationThreads = *max_element(options.threads.begin(), options.threads.end());
+
+    text << endl << "Running " << options.numOps << " random inserts and removes total on keys [0, " << ELIMINATION_KEYS - 1 << "] on " << eliminationThreads << " threads, with and without elimination..." << endl;
+    text << "Results (tree, time in ms, Mops/s):" << endl;
+    for (const char *treeName : {"LFCA", "LFCA-ELIM"}) {
+        Trial trial = RunTree(treeName, OpWeights(0.50, 0.50, 0.00, 0.00, 0), eliminationThreads, fewKeys);
+        text << treeName << ", " << to_string(trial.ms) << ", " << to_string(trial.ops / trial.ms / 1000) << endl;
     }
 }
\ No newline at end of file
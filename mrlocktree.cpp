@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <iostream>
 #include <limits>
 #include <mrlock.h>
@@ -11,46 +12,157 @@ const int TreapMergeThreshold = TREAP_NODES / 2;
 
 using namespace std;
 
-MrlockTree::MrlockTree() : mrlock(1) {
-    // Set up the initial head as a base node
-    head = new Node(Empty);
-    head->treap = Treap::New();
-    head->isRoute = false;
+// Reads a node field that a writer may change concurrently. The value is only trusted once the stripe's version is validated.
+// Acquire pairs with poke, so a node reached through a peeked pointer is seen at least as set up as when it was linked in
+template<typename T>
+static inline T peek(const T &field) {
+#ifdef __GNUC__
+    return __atomic_load_n(&field, __ATOMIC_ACQUIRE);
+#else
+    return *(const volatile T *)&field;
+#endif
+}
+
+// Writes a node field that optimistic readers may peek at the same time
+template<typename T>
+static inline void poke(T &field, T value) {
+#ifdef __GNUC__
+    __atomic_store_n(&field, value, __ATOMIC_RELEASE);
+#else
+    *(volatile T *)&field = value;
+#endif
+}
+
+// Resource sets are either a single word or a Bitset, depending on the number of stripes
+
+static inline void clearResources(uint64_t *resources) {
+    *resources = 0;
+}
+
+static inline void clearResources(Bitset *resources) {
+    resources->Resize(MRLOCK_STRIPES);
+}
+
+static inline void addResource(uint64_t *resources, int stripe) {
+    *resources |= (uint64_t)1 << stripe;
+}
 
-    // Set up the tree lock
-    treeLock.Resize(1);
-    treeLock.Set(1);
+static inline void addResource(Bitset *resources, int stripe) {
+    resources->Set(stripe);
+}
+
+MrlockTree::MrlockTree(bool multiset, uint32_t lockQueueSize) : mrlock(MRLOCK_STRIPES, lockQueueSize), multiset(multiset) {
+    for (int i = 0; i < MRLOCK_STRIPES; i++) {
+        // Set up the initial head of each stripe as a base node
+        heads[i] = new Node(Empty);
+        heads[i]->treap = Treap::New();
+        heads[i]->isRoute = false;
+
+        // Set up the stripe's lock
+        clearResources(&stripeLocks[i]);
+        addResource(&stripeLocks[i], i);
+    }
 }
 
 MrlockTree::~MrlockTree() {
-    if (head != NULL) {
-        // Recursively delete all nodes
-        stack<Node *> nodeStack;
-        nodeStack.push(head);
-
-        while (!nodeStack.empty()) {
-            Node *currentNode = nodeStack.top();
-            nodeStack.pop();
-
-            // Add this node's children, if they exist
-            if (currentNode->left != NULL) {
-                nodeStack.push(currentNode->left);
-            }
-            if (currentNode->right != NULL) {
-                nodeStack.push(currentNode->right);
-            }
+    // Recursively delete all nodes
+    stack<Node *> nodeStack;
+    for (int i = 0; i < MRLOCK_STRIPES; i++) {
+        nodeStack.push(heads[i]);
+    }
 
-            // Delete this node
-            delete currentNode;
+    while (!nodeStack.empty()) {
+        Node *currentNode = nodeStack.top();
+        nodeStack.pop();
+
+        // Add this node's children, if they exist
+        if (currentNode->left != NULL) {
+            nodeStack.push(currentNode->left);
+        }
+        if (currentNode->right != NULL) {
+            nodeStack.push(currentNode->right);
         }
+
+        // Delete this node
+        delete currentNode;
+    }
+
+    for (int i = 0; i < MRLOCK_STRIPES; i++) {
+        for (Node *n : retired[i]) {
+            delete n;
+        }
+    }
+}
+
+MrlockTree::ScopedWrite::ScopedWrite(MrlockTree *tree, int stripe1, int stripe2) {
+    first = &tree->versions[stripe1].value;
+    second = stripe1 == stripe2 ? nullptr : &tree->versions[stripe2].value;
+
+    // Only lock holders write the versions, so plain increments are enough.
+    // Every node write is a release poke, so a reader that peeks at any of them also sees the odd version
+    first->store(first->load(memory_order_relaxed) + 1, memory_order_relaxed);
+    if (second != nullptr) {
+        second->store(second->load(memory_order_relaxed) + 1, memory_order_relaxed);
+    }
+}
+
+MrlockTree::ScopedWrite::~ScopedWrite() {
+    first->store(first->load(memory_order_relaxed) + 1, memory_order_release);
+    if (second != nullptr) {
+        second->store(second->load(memory_order_relaxed) + 1, memory_order_release);
     }
 }
 
-void MrlockTree::insert(int val) {
+int MrlockTree::stripeOf(int val) {
+    return (val >> MRLOCK_STRIPE_SHIFT) & (MRLOCK_STRIPES - 1);
+}
+
+MrlockTree::Resources MrlockTree::pairLocks(int val1, int val2) {
+    Resources resources;
+    clearResources(&resources);
+    addResource(&resources, stripeOf(val1));
+    addResource(&resources, stripeOf(val2));
+    return resources;
+}
+
+MrlockTree::Resources MrlockTree::rangeLocks(int low, int high, vector<int> *stripes) {
+    Resources resources;
+    clearResources(&resources);
+
+    // Wide ranges cover every stripe
+    long long firstBlock = (long long)low >> MRLOCK_STRIPE_SHIFT;
+    long long lastBlock = (long long)high >> MRLOCK_STRIPE_SHIFT;
+    if (lastBlock - firstBlock >= MRLOCK_STRIPES - 1) {
+        lastBlock = firstBlock + MRLOCK_STRIPES - 1;
+    }
+
+    for (long long block = firstBlock; block <= lastBlock; block++) {
+        int stripe = block & (MRLOCK_STRIPES - 1);
+        addResource(&resources, stripe);
+        stripes->push_back(stripe);
+    }
+
+    return resources;
+}
+
+bool MrlockTree::insert(int val) {
+    // Acquire the lock
+    ScopedMrLock lock(&mrlock, stripeLocks[stripeOf(val)]);
+    ScopedWrite write(this, stripeOf(val), stripeOf(val));
+
+    return lockedInsert(val);
+}
+
+bool MrlockTree::remove(int val) {
     // Acquire the lock
-    ScopedMrLock lock(&mrlock, treeLock);
+    ScopedMrLock lock(&mrlock, stripeLocks[stripeOf(val)]);
+    ScopedWrite write(this, stripeOf(val), stripeOf(val));
 
-    Node *temp = head;
+    return lockedRemove(val);
+}
+
+MrlockTree::Node *MrlockTree::findBaseNode(int val) {
+    Node *temp = heads[stripeOf(val)];
 
     // Search until a base node is found
     while (temp->isRoute) {
@@ -62,33 +174,190 @@ void MrlockTree::insert(int val) {
         }
     }
 
-    // Insert the value
-    temp->treap = temp->treap->immutableInsert(val);
+    return temp;
+}
 
-    // If inserting causes the treap to become too large, split it in two
-    if (temp->treap->getSize() >= TreapSplitThreshold) {
-        Node *left = new Node(Empty);
-        left->isRoute = false;
+void MrlockTree::findPath(int val, Node *target, vector<Node *> *path) {
+    Node *temp = heads[stripeOf(val)];
+
+    // Collect the route nodes above the target
+    while (temp != target) {
+        path->push_back(temp);
+        temp = temp->val >= val ? temp->left : temp->right;
+    }
+}
 
-        Node *right = new Node(Empty);
-        right->isRoute = false;
+void MrlockTree::rotate(Node *n, bool toLeft) {
+    // Rotate in place, so that the parent's pointer to n stays valid. The child that moves up gives its key to n, and takes n's key down
+    Node *moved;
+    int val = n->val;
+    if (toLeft) {
+        moved = n->right;
+        poke(n->val, moved->val);
+        poke(moved->val, val);
+        poke(n->right, moved->right);
+        poke(moved->right, moved->left);
+        poke(moved->left, n->left);
+        poke(n->left, moved);
+    }
+    else {
+        moved = n->left;
+        poke(n->val, moved->val);
+        poke(moved->val, val);
+        poke(n->left, moved->left);
+        poke(moved->left, moved->right);
+        poke(moved->right, n->right);
+        poke(n->right, moved);
+    }
+
+    moved->height = 1 + max(moved->left->height, moved->right->height);
+    n->height = 1 + max(n->left->height, n->right->height);
+}
+
+void MrlockTree::rebalance(vector<Node *> *path) {
+    // Walk up from the lowest changed route node, restoring the AVL property
+    while (!path->empty()) {
+        Node *n = path->back();
+        path->pop_back();
 
-        int splitVal = temp->treap->split(&left->treap, &right->treap);
+        int oldHeight = n->height;
+        int balance = n->left->height - n->right->height;
 
-        temp->val = splitVal;
-        temp->isRoute = true;
-        temp->left = left;
-        temp->right = right;
+        if (balance > 1) {
+            if (n->left->right->height > n->left->left->height) {
+                rotate(n->left, true);
+            }
+            rotate(n, false);
+        }
+        else if (balance < -1) {
+            if (n->right->left->height > n->right->right->height) {
+                rotate(n->right, false);
+            }
+            rotate(n, true);
+        }
+        else {
+            n->height = 1 + max(n->left->height, n->right->height);
+        }
 
-        temp->treap = nullptr;
+        // Nodes further up only change if this subtree's height did
+        if (n->height == oldHeight) {
+            return;
+        }
     }
 }
 
-bool MrlockTree::remove(int val) {
-    // Acquire the lock
-    ScopedMrLock lock(&mrlock, treeLock);
+MrlockTree::Node *MrlockTree::newNode(int stripe) {
+    if (retired[stripe].empty()) {
+        return new Node(Empty);
+    }
+
+    // Reuse a node removed from this stripe. Optimistic readers may still be on it, but they fail validation since the stripe is being written
+    Node *n = retired[stripe].back();
+    retired[stripe].pop_back();
+    poke(n->isRoute, true);
+    poke(n->val, Empty);
+    poke(n->treap, (Treap *)nullptr);
+    poke(n->left, (Node *)nullptr);
+    poke(n->right, (Node *)nullptr);
+    n->height = 0;
+    return n;
+}
 
-    Node *temp = head;
+bool MrlockTree::tryMerge(Node *parent, vector<Node *> *retired) {
+    // A merge is possible when both children are base nodes that are small enough to be merged
+    if (parent->left->isRoute || parent->right->isRoute) {
+        return false;
+    }
+
+    int combinedSize = parent->left->treap->getSize() + parent->right->treap->getSize();
+    if (combinedSize > TreapMergeThreshold) {
+        return false;
+    }
+
+    poke(parent->treap, Treap::merge(parent->left->treap, parent->right->treap));
+    poke(parent->isRoute, false);
+    parent->height = 0;
+
+    retired->push_back(parent->left);
+    poke(parent->left, (Node *)nullptr);
+
+    retired->push_back(parent->right);
+    poke(parent->right, (Node *)nullptr);
+
+    return true;
+}
+
+bool MrlockTree::lockedInsert(int val) {
+    Node *temp = findBaseNode(val);
+
+    // Sets keep a single copy of each value, so there is nothing to copy
+    if (!multiset && temp->treap->contains(val)) {
+        return false;
+    }
+
+    // Only multisets fill a treap with a single value, which splitting at the median cannot separate. Split off an empty base node for the value instead.
+    if (temp->treap->getSize() >= TreapSplitThreshold) {
+        int existing = temp->treap->getMinValue();
+        if (val == existing) {
+            throw out_of_range("Cannot insert " + to_string(val) + ": Too many copies of the value");
+        }
+
+        Node *empty = newNode(stripeOf(val));
+        poke(empty->treap, Treap::New());
+        poke(empty->isRoute, false);
+
+        Node *full = newNode(stripeOf(val));
+        poke(full->treap, temp->treap);
+        poke(full->isRoute, false);
+
+        poke(temp->val, min(val, existing));
+        poke(temp->left, val < existing ? empty : full);
+        poke(temp->right, val < existing ? full : empty);
+        poke(temp->treap, (Treap *)nullptr);
+        poke(temp->isRoute, true);
+
+        vector<Node *> path;
+        findPath(val, temp, &path);
+        path.push_back(temp);
+        rebalance(&path);
+
+        temp = empty;
+    }
+
+    // Insert the value
+    poke(temp->treap, temp->treap->immutableInsert(val));
+
+    // If inserting causes the treap to become too large, split it in two
+    if (temp->treap->getSize() >= TreapSplitThreshold) {
+        Node *left = newNode(stripeOf(val));
+        Node *right = newNode(stripeOf(val));
+
+        // The new base nodes are set up before they are linked in
+        Treap *leftTreap;
+        Treap *rightTreap;
+        int splitVal = temp->treap->split(&leftTreap, &rightTreap);
+        poke(left->treap, leftTreap);
+        poke(left->isRoute, false);
+        poke(right->treap, rightTreap);
+        poke(right->isRoute, false);
+
+        poke(temp->val, splitVal);
+        poke(temp->left, left);
+        poke(temp->right, right);
+        poke(temp->treap, (Treap *)nullptr);
+        poke(temp->isRoute, true);
+
+        vector<Node *> path;
+        findPath(val, temp, &path);
+        path.push_back(temp);
+        rebalance(&path);
+    }
+
+    return true;
+}
+
+bool MrlockTree::lockedRemove(int val) {
+    Node *temp = heads[stripeOf(val)];
     Node *tempParent = nullptr;
 
     // Search until a base node is found
@@ -103,57 +372,77 @@ bool MrlockTree::remove(int val) {
         }
     }
 
+    // Removing an absent value changes nothing, so skip the copy
+    if (!temp->treap->contains(val)) {
+        return false;
+    }
+
     // Perform the remove
     bool success;
-    temp->treap = temp->treap->immutableRemove(val, &success);
-
-    // Check if a merge is possible. This is when the node has a parent, and the node's sibling is also a base node
-    bool mergeIsPossible = tempParent != nullptr && !tempParent->left->isRoute && !tempParent->right->isRoute;
-
-    if (mergeIsPossible) {
-        // Check if the two nodes are small enough to be merged
-        int combinedSize = tempParent->left->treap->getSize() + tempParent->right->treap->getSize();
-        if (combinedSize <= TreapMergeThreshold) {
-            tempParent->treap = Treap::merge(tempParent->left->treap, tempParent->right->treap);
-            tempParent->isRoute = false;
+    poke(temp->treap, temp->treap->immutableRemove(val, &success));
 
-            delete(tempParent->left);
-            tempParent->left = nullptr;
+    // Merge with the sibling if it is also a small base node, and keep merging upwards while the merged node and its new sibling are small enough
+    if (tempParent != nullptr && tryMerge(tempParent, &retired[stripeOf(val)])) {
+        vector<Node *> path;
+        findPath(val, tempParent, &path);
 
-            delete(tempParent->right);
-            tempParent->right = nullptr;
+        while (!path.empty() && tryMerge(path.back(), &retired[stripeOf(val)])) {
+            path.pop_back();
         }
+
+        rebalance(&path);
     }
 
     return success;
 }
 
 bool MrlockTree::lookup(int val) {
-    // Acquire the lock
-    ScopedMrLock lock(&mrlock, treeLock);
+    if (optimisticReads) {
+        int stripe = stripeOf(val);
+        atomic<uint32_t> &version = versions[stripe].value;
+
+        for (int attempt = 0; attempt < OPTIMISTIC_ATTEMPTS; attempt++) {
+            uint32_t before = version.load(memory_order_acquire);
+            if (before & 1) {
+                MRLOCK_PAUSE();
+                continue;
+            }
 
-    Node *temp = head;
+            // Writers change the nodes while this runs, so anything read here may be inconsistent until the version is validated
+            Node *temp = heads[stripe];
+            Treap *treap = nullptr;
+            for (int depth = 0; temp != nullptr && depth < OPTIMISTIC_MAX_DEPTH; depth++) {
+                if (!peek(temp->isRoute)) {
+                    treap = peek(temp->treap);
+                    break;
+                }
+                temp = peek(temp->val) >= val ? peek(temp->left) : peek(temp->right);
+            }
 
-    // Search until a base node is found
-    while (temp->isRoute) {
-        if (temp->val >= val) {
-            temp = temp->left;
-        }
-        else {
-            temp = temp->right;
+            // The peeks are acquire loads, so this check cannot move above them, and it sees the odd version of any write they saw.
+            // Treaps are immutable once published, so a validated treap can be searched after the check
+            if (treap != nullptr && version.load(memory_order_relaxed) == before) {
+                return treap->contains(val);
+            }
         }
     }
 
-    return temp->treap->contains(val);
+    // Otherwise acquire the lock, shared with other readers
+    ScopedMrLock lock(&mrlock, stripeLocks[stripeOf(val)], true);
+
+    return findBaseNode(val)->treap->contains(val);
 }
 
 vector<int> MrlockTree::rangeQuery(int low, int high) {
-    // Acquire the lock
-    ScopedMrLock lock(&mrlock, treeLock);
+    // Acquire the locks of every stripe the range covers, shared with other readers
+    vector<int> stripes;
+    ScopedMrLock lock(&mrlock, rangeLocks(low, high, &stripes), true);
 
     vector<int> result;
     vector<Node *> nodesToCheck;
-    nodesToCheck.push_back(head);
+    for (int stripe : stripes) {
+        nodesToCheck.push_back(heads[stripe]);
+    }
 
     while (!nodesToCheck.empty()) {
         Node *temp = nodesToCheck.back();
@@ -179,3 +468,67 @@ vector<int> MrlockTree::rangeQuery(int low, int high) {
 
     return result;
 }
+
+bool MrlockTree::insertIfAbsent(int val, int absent) {
+    // Acquire the locks of both stripes at once
+    ScopedMrLock lock(&mrlock, pairLocks(val, absent));
+    ScopedWrite write(this, stripeOf(val), stripeOf(absent));
+
+    if (findBaseNode(absent)->treap->contains(absent) || findBaseNode(val)->treap->contains(val)) {
+        return false;
+    }
+
+    lockedInsert(val);
+    return true;
+}
+
+bool MrlockTree::move(int from, int to) {
+    // Acquire the locks of both stripes at once
+    ScopedMrLock lock(&mrlock, pairLocks(from, to));
+    ScopedWrite write(this, stripeOf(from), stripeOf(to));
+
+    if (!findBaseNode(from)->treap->contains(from) || findBaseNode(to)->treap->contains(to)) {
+        return false;
+    }
+
+    lockedRemove(from);
+    lockedInsert(to);
+    return true;
+}
+
+bool MrlockTree::compareAndSwap(int expected, int desired) {
+    // Acquire the locks of both stripes at once
+    ScopedMrLock lock(&mrlock, pairLocks(expected, desired));
+    ScopedWrite write(this, stripeOf(expected), stripeOf(desired));
+
+    if (!findBaseNode(expected)->treap->contains(expected)) {
+        return false;
+    }
+
+    lockedRemove(expected);
+    if (!findBaseNode(desired)->treap->contains(desired)) {
+        lockedInsert(desired);
+    }
+    return true;
+}
+
+int MrlockTree::height() {
+    // Lock every stripe, shared with other readers
+    Resources resources;
+    clearResources(&resources);
+    for (int i = 0; i < MRLOCK_STRIPES; i++) {
+        addResource(&resources, i);
+    }
+    ScopedMrLock lock(&mrlock, resources, true);
+
+    int result = 0;
+    for (int i = 0; i < MRLOCK_STRIPES; i++) {
+        result = max(result, heads[i]->height);
+    }
+
+    return result;
+}
+
+void MrlockTree::setOptimisticReads(bool enabled) {
+    optimisticReads = enabled;
+}
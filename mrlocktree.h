@@ -1,17 +1,38 @@
 #ifndef _MRLOCKTREE_H
 #define _MRLOCKTREE_H
 
+#include <atomic>
 #include <bitset.h>
+#include <cstdint>
 #include <mrlock.h>
+#include <type_traits>
 #include "searchtree.h"
 #include "treap.h"
 
+#define MRLOCK_STRIPES 64       // Number of independently locked subtrees. Must be a power of 2
+#define MRLOCK_STRIPE_SHIFT 12  // Keys are striped in blocks of 2^MRLOCK_STRIPE_SHIFT consecutive values
+#define OPTIMISTIC_ATTEMPTS 8    // Optimistic lookups that fail validation this often take the lock instead
+#define OPTIMISTIC_MAX_DEPTH 128  // Longer paths can only be seen during concurrent rotations, so the lookup is retried
+
+/**
+ * A search tree protected by a multi-resource lock.
+ *
+ * The keys are divided into stripes of consecutive blocks, assigned round-robin. Each stripe is a separate subtree guarded by its own lock bit,
+ * so operations only lock the stripes of the keys they touch, and range queries lock the stripes of the blocks they cover.
+ * Splits and merges stay within a stripe, so they never need more than that stripe's bit.
+ * Lookups and range queries lock their stripes in shared mode, so readers only wait for writers.
+ * The route nodes of each stripe are kept AVL balanced, so sequential keys do not degrade a stripe into a chain.
+ *
+ * Every update also bumps a seqlock-style version of its stripes, which allows lookups to run without the lock when optimistic reads are enabled.
+ * Nodes removed by merges are kept for reuse within their stripe instead of being freed, so optimistic readers never follow a pointer into freed memory.
+ */
 class MrlockTree : public SearchTree {
 private:
     struct Node {
         bool isRoute {true};
         int val;
         Treap* treap {NULL};
+        int height {0};  // Route nodes on the longest path from this node to a base node
 
         Node *left {NULL};
         Node *right {NULL};
@@ -21,15 +42,18 @@ private:
         }
     };
 
+    // Up to 64 stripes fit in one word, which avoids allocating and looping over a Bitset
+    typedef std::conditional<(MRLOCK_STRIPES <= 64), uint64_t, Bitset>::type Resources;
+
     class ScopedMrLock {
     private:
         uint32_t handle;
-        MRLock<Bitset> *lock;
+        MRLock<Resources> *lock;
 
     public:
-        ScopedMrLock(MRLock<Bitset> *mrlock, Bitset resources) {
+        ScopedMrLock(MRLock<Resources> *mrlock, const Resources &resources, bool shared = false) {
             lock = mrlock;
-            handle = mrlock->Lock(resources);
+            handle = mrlock->Lock(resources, shared);
         }
 
         ~ScopedMrLock() {
@@ -37,19 +61,87 @@ private:
         }
     };
 
-    Node *head {NULL};
+    // Marks up to two stripes as being written, so that optimistic readers of those stripes retry
+    class ScopedWrite {
+    private:
+        std::atomic<uint32_t> *first;
+        std::atomic<uint32_t> *second;
+
+    public:
+        ScopedWrite(MrlockTree *tree, int stripe1, int stripe2);
+        ~ScopedWrite();
+    };
+
+    // Padded so that writers of one stripe do not invalidate the versions of others
+    struct StripeVersion {
+        std::atomic<uint32_t> value {0};  // Odd while the stripe is being written
+        char pad[64 - sizeof(std::atomic<uint32_t>)];
+    };
 
-    MRLock<Bitset> mrlock;
-    Bitset treeLock;
+    Node *heads[MRLOCK_STRIPES];
+    vector<Node *> retired[MRLOCK_STRIPES];  // Nodes removed from each stripe, for reuse within that stripe
+    StripeVersion versions[MRLOCK_STRIPES];
+
+    MRLock<Resources> mrlock;
+    Resources stripeLocks[MRLOCK_STRIPES];  // The lock bit of each stripe
+
+    bool multiset;
+    bool optimisticReads {false};
+
+    static int stripeOf(int val);
+    Resources pairLocks(int val1, int val2);
+    Resources rangeLocks(int low, int high, vector<int> *stripes);
+
+    // These must be called with the stripes of their values locked
+    Node *findBaseNode(int val);
+    void findPath(int val, Node *target, vector<Node *> *path);
+    Node *newNode(int stripe);
+    static bool tryMerge(Node *parent, vector<Node *> *retired);
+    static void rotate(Node *n, bool toLeft);
+    static void rebalance(vector<Node *> *path);
+    bool lockedInsert(int val);
+    bool lockedRemove(int val);
 
 public:
-    MrlockTree();
+    /**
+     * Creates an empty tree.
+     *
+     * @param multiset
+     * Whether the tree keeps duplicate values.
+     *
+     * @param lockQueueSize
+     * The number of lock requests that can be queued at once. Threads beyond this wait for a free slot.
+     * The default of 0 sizes the queue from the number of hardware threads.
+     */
+    MrlockTree(bool multiset = false, uint32_t lockQueueSize = 0);
     ~MrlockTree();
 
-    void insert(int val);
+    bool insert(int val);
     bool remove(int val);
     bool lookup(int val);
     vector<int> rangeQuery(int low, int high);
+
+    bool insertIfAbsent(int val, int absent);
+    bool move(int from, int to);
+    bool compareAndSwap(int expected, int desired);
+
+    /**
+     * Gets the height of the highest stripe.
+     *
+     * @return int
+     * The number of route nodes on the longest path from a stripe's head to a base node.
+     */
+    int height();
+
+    /**
+     * Enables or disables optimistic lookups. When enabled, lookups traverse their stripe without the lock,
+     * and validate the result against the stripe's version. They take the lock after repeated concurrent updates of the stripe.
+     * Enabling this must happen before the tree is shared between threads.
+     *
+     * @param enabled
+     * Whether to look up values without the lock.
+     */
+    void setOptimisticReads(bool enabled);
 };
 
 #endif /* _MRLOCKTREE_H */
@@ -8,7 +8,10 @@
 #ifndef _PREALLOCATABLE_H
 #define _PREALLOCATABLE_H
 
+#include <algorithm>
 #include <atomic>
+#include <memory>
+#include <new>
 #include <stdexcept>
 #include <string>
 #include <typeinfo>
@@ -31,6 +34,10 @@ private:
         static T *_val{nullptr};
         return _val;
     }
+    static char *&_buffer() {
+        static char *_val{nullptr};
+        return _val;
+    }
     static std::atomic<int> &_currentElementIndex() {
         static std::atomic<int> _val{0};
         return _val;
@@ -48,7 +55,19 @@ public:
             throw std::logic_error(std::string("Cannot preallocate: Class ") + typeid(T).name() + " is already preallocated.");
         }
 
-        _preallocatedElements() = new T[numElements];
+        // Before C++17, new[] only aligns to the fundamental alignment. Align the elements by hand, so that classes can be aligned to cache lines.
+        size_t size = numElements * sizeof(T);
+        size_t space = size + alignof(T);
+        _buffer() = new char[space];
+
+        void *elements = _buffer();
+        std::align(alignof(T), size, elements, space);
+
+        _preallocatedElements() = static_cast<T *>(elements);
+        for (int i = 0; i < numElements; i++) {
+            new (&_preallocatedElements()[i]) T();
+        }
+
         _numPreallocated() = numElements;
         _isPreallocated() = true;
         _currentElementIndex().store(0);
@@ -58,7 +77,16 @@ public:
      * Deallocates all preallocated elements.
      */
     static void Deallocate() {
-        delete[] _preallocatedElements();
+        if (!_isPreallocated()) {
+            return;
+        }
+
+        for (int i = 0; i < _numPreallocated(); i++) {
+            _preallocatedElements()[i].~T();
+        }
+
+        delete[] _buffer();
+        _buffer() = nullptr;
         _isPreallocated() = false;
     };
 
@@ -74,8 +102,8 @@ public:
             throw std::logic_error(std::string("Cannot retrieve preallocated element of class ") + typeid(T).name() + ": No elements have been preallocated");
         }
 
-        // Get a node index
-        int index = _currentElementIndex().fetch_add(1);
+        // Get a node index. The elements are constructed before any thread can call this, so the index only needs to be unique.
+        int index = _currentElementIndex().fetch_add(1, std::memory_order_relaxed);
 
         // Verify that this is a valid index
         if (index >= _numPreallocated()) {
@@ -86,6 +114,16 @@ public:
         return &_preallocatedElements()[index];
     };
 
+    /**
+     * Retrieves the number of preallocated elements that have been handed out since preallocating.
+     *
+     * @return int
+     * The number of elements retrieved with `New()`.
+     */
+    static int NumAllocated() {
+        return std::min(_currentElementIndex().load(), _numPreallocated());
+    }
+
     /**
      * Retrieves a preallocated element, copying from the other element using the assignment operator.
      * Note that this does *not* use the copy constructor.
@@ -6,10 +6,15 @@
 class SearchTree {
 public:
     virtual ~SearchTree() { };
-    virtual void insert(int val) = 0;
+    virtual bool insert(int val) = 0;  // Returns false if the value was already in the tree, unless the tree is a multiset
     virtual bool remove(int val) = 0;
     virtual bool lookup(int val) = 0;
     virtual std::vector<int> rangeQuery(int low, int high) = 0;
+
+    // Atomic multi-key operations. Values are never duplicated by these.
+    virtual bool insertIfAbsent(int val, int absent) = 0;         // Insert val if absent is not in the tree
+    virtual bool move(int from, int to) = 0;                       // Replace from with to, if from is in the tree and to is not
+    virtual bool compareAndSwap(int expected, int desired) = 0;  // Replace expected with desired, if expected is in the tree
 };
 
 #endif /* _SEARCHTREE_H */
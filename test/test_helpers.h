@@ -0,0 +1,96 @@
+/**
+ * Thread bodies and checks shared by the parallel tests of every tree.
+ */
+
+#ifndef _TEST_HELPERS_H
+#define _TEST_HELPERS_H
+
+#include <atomic>
+#include <functional>
+#include <gtest/gtest.h>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "../searchtree.h"
+
+// Moves tokens between random keys in {0, spacing, ..., maxIndex * spacing}. Moves never add or remove a token
+inline void moveTokensThread(SearchTree *tree, int seed, int numOps, int maxIndex, int spacing) {
+    std::mt19937 randEngine(seed);
+    std::uniform_int_distribution<int> indexDist(0, maxIndex);
+
+    for (int i = 0; i < numOps; i++) {
+        tree->move(indexDist(randEngine) * spacing, indexDist(randEngine) * spacing);
+    }
+}
+
+/**
+ * Inserts numTokens tokens spaced 4 * spacing apart, and moves them around on numMovers threads.
+ * Meanwhile, numCheckers threads run check until the movers are done. Afterwards, the tree must hold exactly the tokens.
+ */
+inline void runTokenMoves(SearchTree *tree, int numTokens, int spacing, int numMovers, int numOps, int numCheckers, std::function<void(std::atomic<bool> *stop)> check) {
+    for (int i = 0; i < numTokens; i++) {
+        tree->insert(i * 4 * spacing);
+    }
+
+    std::atomic<bool> stop{false};
+    std::vector<std::thread> checkers;
+    for (int i = 0; i < numCheckers; i++) {
+        checkers.push_back(std::thread(check, &stop));
+    }
+
+    std::vector<std::thread> movers;
+    for (int i = 0; i < numMovers; i++) {
+        movers.push_back(std::thread(moveTokensThread, tree, i, numOps, 4 * numTokens, spacing));
+    }
+
+    for (std::thread &t : movers) {
+        t.join();
+    }
+    stop.store(true);
+    for (std::thread &t : checkers) {
+        t.join();
+    }
+
+    EXPECT_EQ((size_t)numTokens, tree->rangeQuery(0, 4 * numTokens * spacing).size());
+}
+
+// Alternately inserts and removes random values in [0, maxVal], and counts the updates that changed the tree
+inline void insertRemoveThread(SearchTree *tree, int seed, int numOps, int maxVal, int *inserted, int *removed) {
+    std::mt19937 randEngine(seed);
+    std::uniform_int_distribution<int> valDist(0, maxVal);
+
+    for (int i = 0; i < numOps; i++) {
+        int val = valDist(randEngine);
+        if (i % 2 == 0) {
+            *inserted += tree->insert(val) ? 1 : 0;
+        }
+        else {
+            *removed += tree->remove(val) ? 1 : 0;
+        }
+    }
+}
+
+/**
+ * Runs update on numThreads threads, each with its own seed and counters of the inserts and removes that changed the tree.
+ * Afterwards, the values in [0, maxVal] must match what the threads counted.
+ */
+inline void runCountedUpdates(SearchTree *tree, int numThreads, int maxVal, std::function<void(int seed, int *inserted, int *removed)> update) {
+    std::vector<std::thread> threads;
+    std::vector<int> inserted(numThreads, 0);
+    std::vector<int> removed(numThreads, 0);
+    int expectedSize = tree->rangeQuery(0, maxVal).size();
+
+    for (int i = 0; i < numThreads; i++) {
+        threads.push_back(std::thread(update, i, &inserted.at(i), &removed.at(i)));
+    }
+
+    for (int i = 0; i < numThreads; i++) {
+        threads.at(i).join();
+        expectedSize += inserted.at(i) - removed.at(i);
+    }
+
+    EXPECT_EQ((size_t)expectedSize, tree->rangeQuery(0, maxVal).size());
+}
+
+#endif /* _TEST_HELPERS_H */
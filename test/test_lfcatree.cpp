@@ -1,9 +1,15 @@
+#include <atomic>
 #include <gtest/gtest.h>
+#include <memory>
+#include <random>
+#include <sstream>
 #include <thread>
 #include <vector>
 
 #include "../treap.h"
 #include "../lfca.h"
+#include "../lfcabatcher.h"
+#include "test_helpers.h"
 
 #define NUM_THREADS 8
 #define PARALLEL_START 0
@@ -12,7 +18,16 @@
 // These values are estimates, due to the nondeterministic nature of the parallel tests.
 #define MAX_TREAPS_NEEDED (2 * 2 * (PARALLEL_END - PARALLEL_START))  // insert and remove for ParallelRemove, with 2 retries per operation
 #define MAX_NODES_NEEDED (4 * (PARALLEL_END - PARALLEL_START))
-#define MAX_RESULT_SETS_NEEDED 1024  // RangeQueryBulkTest
+#define MAX_RESULT_SETS_NEEDED (1024 + COVERED_RANGE_ROUNDS * (COVERED_RANGE_WIDE_QUERIES + 2 * COVERED_RANGE_NARROW_QUERIES))  // RangeQueryBulkTest and ParallelCoveredRangeQueries
+#define MAX_MULTI_STORAGES_NEEDED (NUM_THREADS * MULTI_OPS_PER_THREAD)  // ParallelMoveKeepsCount
+#define MULTI_OPS_PER_THREAD 5000
+#define MULTI_TOKENS 200
+#define COVERED_RANGE_KEYS 256
+#define COVERED_RANGE_ROUNDS 50
+#define COVERED_RANGE_WIDE_QUERIES 5000   // Most per round
+#define COVERED_RANGE_NARROW_QUERIES 200  // Per thread and round
+#define COVERED_RANGE_UPDATES 200         // Per thread and round
+#define CONTENTION_ROUNDS 16              // Most rounds of ParallelElimination and ParallelCombining
 
 class LfcaTreeTest : public ::testing::Test {
 protected:
@@ -22,6 +37,7 @@ protected:
         Treap::Preallocate(MAX_TREAPS_NEEDED);
         node::Preallocate(MAX_NODES_NEEDED);
         rs::Preallocate(MAX_RESULT_SETS_NEEDED);
+        ms::Preallocate(MAX_MULTI_STORAGES_NEEDED);
 
         lfcaTree = new LfcaTree();
     }
@@ -29,6 +45,7 @@ protected:
         Treap::Deallocate();
         node::Deallocate();
         rs::Deallocate();
+        ms::Deallocate();
 
         delete lfcaTree;
     }
@@ -123,6 +140,70 @@ TEST_F(LfcaTreeTest, RangeQueryBulkTest) {
     }
 }
 
+TEST_F(LfcaTreeTest, InsertReportsExisting) {
+    for (int i = 0; i < TREAP_NODES; i++) {
+        EXPECT_TRUE(lfcaTree->insert(i));
+    }
+
+    // Inserting existing values neither duplicates them nor fills up the base node
+    for (int i = 0; i < TREAP_NODES; i++) {
+        EXPECT_FALSE(lfcaTree->insert(i));
+    }
+    EXPECT_EQ(0, lfcaTree->describe().routeNodes);
+    EXPECT_EQ((size_t)TREAP_NODES, lfcaTree->rangeQuery(0, TREAP_NODES).size());
+
+    EXPECT_TRUE(lfcaTree->remove(0));
+    EXPECT_FALSE(lfcaTree->lookup(0));
+}
+
+TEST_F(LfcaTreeTest, UnchangedUpdatesDoNotAllocate) {
+    for (int i = 0; i < 1000; i += 2) {
+        lfcaTree->insert(i);
+    }
+
+    int treaps = Treap::NumAllocated();
+    int nodes = node::NumAllocated();
+
+    for (int i = 1; i < 1000; i += 2) {
+        EXPECT_FALSE(lfcaTree->remove(i));
+    }
+    for (int i = 0; i < 1000; i += 2) {
+        EXPECT_FALSE(lfcaTree->insert(i));
+    }
+
+    EXPECT_EQ(treaps, Treap::NumAllocated());
+    EXPECT_EQ(nodes, node::NumAllocated());
+}
+
+TEST_F(LfcaTreeTest, Multiset) {
+    LfcaTree multisetTree(false, true);
+
+    EXPECT_TRUE(multisetTree.insert(1));
+    EXPECT_TRUE(multisetTree.insert(1));
+    EXPECT_EQ((vector<int>{1, 1}), multisetTree.rangeQuery(1, 1));
+
+    EXPECT_TRUE(multisetTree.remove(1));
+    EXPECT_TRUE(multisetTree.lookup(1));
+    EXPECT_TRUE(multisetTree.remove(1));
+    EXPECT_FALSE(multisetTree.lookup(1));
+
+    for (int i = 0; i < TREAP_NODES; i++) {
+        multisetTree.insert(2);
+    }
+    EXPECT_THROW(multisetTree.insert(2), out_of_range);
+    EXPECT_TRUE(multisetTree.insert(3));
+    EXPECT_TRUE(multisetTree.insert(0));
+    EXPECT_EQ((size_t)TREAP_NODES + 2, multisetTree.rangeQuery(0, 3).size());
+
+    // Fill a base node with mostly copies of its maximum, then insert below them
+    EXPECT_TRUE(multisetTree.insert(9));
+    for (int i = 0; i < TREAP_NODES; i++) {
+        EXPECT_TRUE(multisetTree.insert(10));
+    }
+    EXPECT_TRUE(multisetTree.insert(9));
+    EXPECT_EQ((size_t)TREAP_NODES + 2, multisetTree.rangeQuery(9, 10).size());
+}
+
 TEST_F(LfcaTreeTest, LowContentionMergeFailure) {
     // Fill up the base node
     for (int i = 0; i < TREAP_NODES; i++) {
@@ -254,6 +335,272 @@ TEST_F(LfcaTreeTest, LowContentionMergeRightWithLeftRoute) {
     }
 }
 
+TEST_F(LfcaTreeTest, LowContentionMergeDeepTree) {
+    // Sequential inserts build a long chain of route nodes
+    int numVals = TREAP_NODES * 16;
+    for (int i = 0; i < numVals; i++) {
+        lfcaTree->insert(i);
+    }
+
+    // Shrink the deepest base nodes so that they can be joined
+    for (int i = numVals - TREAP_NODES; i < numVals - 1; i++) {
+        lfcaTree->remove(i);
+    }
+
+    int routeNodesBefore = lfcaTree->describe().routeNodes;
+
+    // Force joins deep in the chain, where the grandparent is far from the root
+    int uncontendedOpsNeeded = abs(LOW_CONT / LOW_CONT_CONTRIB);
+    int testVal = numVals - 1;
+    for (int i = 0; i < 2 * uncontendedOpsNeeded; i++) {
+        lfcaTree->remove(testVal);
+        lfcaTree->insert(testVal);
+    }
+
+    EXPECT_LT(lfcaTree->describe().routeNodes, routeNodesBefore);
+
+    for (int i = 0; i < numVals - TREAP_NODES; i++) {
+        ASSERT_TRUE(lfcaTree->lookup(i));
+    }
+    ASSERT_TRUE(lfcaTree->lookup(testVal));
+}
+
+TEST_F(LfcaTreeTest, RangeQueryStartingAtRouteKey) {
+    for (int i = 0; i < TREAP_NODES * 2; i++) {
+        lfcaTree->insert(i);
+    }
+
+    // Split keys are values in the tree, so some of these queries start exactly at a route node's key
+    for (int i = 0; i < TREAP_NODES * 2 - 1; i++) {
+        vector<int> actual = lfcaTree->rangeQuery(i, i + 1);
+        sort(actual.begin(), actual.end());
+        EXPECT_EQ((vector<int>{i, i + 1}), actual);
+    }
+}
+
+TEST_F(LfcaTreeTest, MvccRangeQuery) {
+    LfcaTree mvccTree(true);
+    mvccTree.setTracing(true);
+
+    for (int i = 0; i < 1000; i++) {
+        mvccTree.insert(i);
+    }
+
+    vector<int> expected;
+    for (int i = 100; i <= 200; i++) {
+        expected.push_back(i);
+    }
+    vector<int> actual = mvccTree.rangeQuery(100, 200);
+    sort(actual.begin(), actual.end());
+    EXPECT_EQ(expected, actual);
+    EXPECT_EQ(vector<int>{}, mvccTree.rangeQuery(1000, 2000));
+
+    mvccTree.setTracing(false);
+
+    // No range base nodes are installed
+    stringstream trace;
+    mvccTree.dumpTrace(trace);
+    EXPECT_NE(string::npos, trace.str().find("\"name\":\"split\""));
+    EXPECT_EQ(string::npos, trace.str().find("\"name\":\"range\""));
+}
+
+TEST_F(LfcaTreeTest, TraceRecordsAdaptations) {
+    lfcaTree->setTracing(true);
+
+    // Overfill the root base node to force a split, then run a range query over both base nodes
+    for (int i = 0; i <= TREAP_NODES; i++) {
+        lfcaTree->insert(i);
+    }
+    lfcaTree->rangeQuery(0, TREAP_NODES);
+
+    lfcaTree->setTracing(false);
+    lfcaTree->insert(TREAP_NODES + 1);
+
+    stringstream trace;
+    lfcaTree->dumpTrace(trace);
+    string json = trace.str();
+
+    EXPECT_EQ(0u, json.find("{\"traceEvents\":["));
+    EXPECT_NE(string::npos, json.find("\"name\":\"split\""));
+    EXPECT_NE(string::npos, json.find("\"name\":\"range\""));
+    EXPECT_EQ(string::npos, json.find("\"name\":\"join\""));
+}
+
+TEST_F(LfcaTreeTest, TraceIsPerTree) {
+    LfcaTree otherTree;
+    otherTree.setTracing(true);
+    for (int i = 0; i <= TREAP_NODES; i++) {
+        otherTree.insert(i);
+    }
+
+    // Events recorded for the other tree must not show up in this tree's trace
+    stringstream trace;
+    lfcaTree->dumpTrace(trace);
+    EXPECT_EQ(string::npos, trace.str().find("\"name\""));
+}
+
+TEST_F(LfcaTreeTest, TraceDropsUnregisteredThreads) {
+    lfcaTree->setTracing(true);
+
+    // The split happens on a thread that never registered a buffer, so recording it must not allocate one
+    thread splitter([this]() {
+        for (int i = 0; i <= TREAP_NODES; i++) {
+            lfcaTree->insert(i);
+        }
+    });
+    splitter.join();
+
+    lfcaTree->setTracing(false);
+
+    stringstream trace;
+    lfcaTree->dumpTrace(trace);
+    EXPECT_EQ(string::npos, trace.str().find("\"name\""));
+}
+
+TEST_F(LfcaTreeTest, DescribeSingleBase) {
+    for (int i = 0; i < 10; i++) {
+        lfcaTree->insert(i);
+    }
+
+    LfcaTreeDescription description = lfcaTree->describe();
+    EXPECT_EQ(0, description.height);
+    EXPECT_EQ(0, description.routeNodes);
+    EXPECT_EQ(1, description.baseNodes);
+    EXPECT_EQ(1, description.sizeHistogram.at(10));
+    EXPECT_EQ(1, description.statHistogram[-10]);
+}
+
+TEST_F(LfcaTreeTest, DescribeAfterSplits) {
+    for (int i = 0; i < TREAP_NODES * 4; i++) {
+        lfcaTree->insert(i);
+    }
+
+    LfcaTreeDescription description = lfcaTree->describe();
+    EXPECT_EQ(description.routeNodes + 1, description.baseNodes);
+    EXPECT_GE(description.height, 2);
+    EXPECT_LE(description.height, description.routeNodes);
+
+    // Every item is accounted for in the size histogram
+    int items = 0;
+    int bases = 0;
+    for (int size = 0; size <= TREAP_NODES; size++) {
+        items += size * description.sizeHistogram.at(size);
+        bases += description.sizeHistogram.at(size);
+    }
+    EXPECT_EQ(TREAP_NODES * 4, items);
+    EXPECT_EQ(description.baseNodes, bases);
+
+    stringstream graph;
+    lfcaTree->dumpGraphviz(graph);
+    EXPECT_EQ(0u, graph.str().find("digraph lfca {"));
+}
+
+TEST_F(LfcaTreeTest, SnapshotIgnoresLaterUpdates) {
+    for (int i = 0; i < 1000; i++) {
+        lfcaTree->insert(i);
+    }
+
+    LfcaSnapshot snapshot = lfcaTree->snapshot();
+
+    // Change the values and the shape of the tree after the snapshot was taken
+    for (int i = 0; i < 1000; i += 2) {
+        lfcaTree->remove(i);
+    }
+    for (int i = 1000; i < 2000; i++) {
+        lfcaTree->insert(i);
+    }
+    int uncontendedOpsNeeded = abs(LOW_CONT / LOW_CONT_CONTRIB);
+    for (int i = 0; i < 2 * uncontendedOpsNeeded; i++) {
+        lfcaTree->remove(1);
+        lfcaTree->insert(1);
+    }
+
+    vector<int> expected;
+    for (int i = 0; i < 1000; i++) {
+        expected.push_back(i);
+    }
+
+    vector<int> actual;
+    while (snapshot.hasNext()) {
+        actual.push_back(snapshot.next());
+    }
+    EXPECT_EQ(expected, actual);
+
+    // A new snapshot sees the updates
+    LfcaSnapshot newSnapshot = lfcaTree->snapshot();
+    EXPECT_GT(newSnapshot.timestamp(), snapshot.timestamp());
+    EXPECT_EQ(1, newSnapshot.next());
+    EXPECT_EQ(3, newSnapshot.next());
+}
+
+TEST_F(LfcaTreeTest, SnapshotRange) {
+    for (int i = 0; i < 1000; i++) {
+        lfcaTree->insert(i);
+    }
+
+    LfcaSnapshot snapshot = lfcaTree->snapshot(100, 200);
+
+    vector<int> expected;
+    for (int i = 100; i <= 200; i++) {
+        expected.push_back(i);
+    }
+
+    vector<int> actual;
+    while (snapshot.hasNext()) {
+        actual.push_back(snapshot.next());
+    }
+    EXPECT_EQ(expected, actual);
+    EXPECT_THROW(snapshot.next(), out_of_range);
+
+    // The rest of a partially read snapshot can be collected at once
+    LfcaSnapshot partial = lfcaTree->snapshot(100, 200);
+    vector<int> rest {partial.next(), partial.next()};
+    partial.appendRemaining(&rest);
+    sort(rest.begin(), rest.end());
+    EXPECT_EQ(expected, rest);
+    EXPECT_FALSE(partial.hasNext());
+}
+
+TEST_F(LfcaTreeTest, MultiKeyOperations) {
+    // Values 0 and 1 share a base node, while 0 and 1000 end up in different base nodes after the splits
+    for (int i = 0; i < 1000; i += 2) {
+        lfcaTree->insert(i);
+    }
+
+    EXPECT_FALSE(lfcaTree->insertIfAbsent(1, 0));
+    EXPECT_FALSE(lfcaTree->lookup(1));
+    EXPECT_TRUE(lfcaTree->insertIfAbsent(1001, 1003));
+    EXPECT_TRUE(lfcaTree->lookup(1001));
+    EXPECT_FALSE(lfcaTree->insertIfAbsent(1001, 1003));  // Values are not duplicated
+
+    EXPECT_TRUE(lfcaTree->move(0, 1));
+    EXPECT_FALSE(lfcaTree->lookup(0));
+    EXPECT_TRUE(lfcaTree->lookup(1));
+    EXPECT_TRUE(lfcaTree->move(1, 1005));
+    EXPECT_FALSE(lfcaTree->lookup(1));
+    EXPECT_TRUE(lfcaTree->lookup(1005));
+    EXPECT_FALSE(lfcaTree->move(1, 3));     // From is absent
+    EXPECT_FALSE(lfcaTree->move(2, 1005));  // To is present
+    EXPECT_TRUE(lfcaTree->lookup(2));
+
+    EXPECT_FALSE(lfcaTree->compareAndSwap(3, 5));
+    EXPECT_TRUE(lfcaTree->compareAndSwap(2, 1005));
+    EXPECT_FALSE(lfcaTree->lookup(2));
+    EXPECT_TRUE(lfcaTree->remove(1005));
+    EXPECT_FALSE(lfcaTree->remove(1005));
+    EXPECT_TRUE(lfcaTree->compareAndSwap(4, 4));
+    EXPECT_TRUE(lfcaTree->lookup(4));
+
+    // Frozen base nodes are released again
+    EXPECT_EQ(499u, lfcaTree->rangeQuery(0, 2000).size());
+    LfcaTreeDescription description = lfcaTree->describe();
+    int items = 0;
+    for (int size = 0; size <= TREAP_NODES; size++) {
+        items += size * description.sizeHistogram.at(size);
+    }
+    EXPECT_EQ(499, items);
+}
+
 static void insertThread(LfcaTree *tree, int start, int end, int delta) {
     for (int i = start; i <= end; i += delta) {
         tree->insert(i);
@@ -338,3 +685,441 @@ TEST_F(LfcaTreeTest, ParallelRemovePartial) {
         ASSERT_TRUE(lfcaTree->lookup(i));
     }
 }
+
+static void rangeQueryThread(LfcaTree *tree, int start, int end, int numQueries, bool *ok) {
+    for (int i = 0; i < numQueries; i++) {
+        int lo = start + (i * 97) % (end - start);
+        int hi = lo + 500;
+
+        vector<int> result = tree->rangeQuery(lo, hi);
+        sort(result.begin(), result.end());
+
+        // Results must be in range and must not contain duplicates
+        if (adjacent_find(result.begin(), result.end()) != result.end()) {
+            *ok = false;
+        }
+        if (!result.empty() && (result.front() < lo || result.back() > hi)) {
+            *ok = false;
+        }
+    }
+}
+
+TEST_F(LfcaTreeTest, ParallelRangeQueryAndInsert) {
+    vector<thread> threads;
+    bool ok[NUM_THREADS / 2];
+
+    for (int i = 0; i < NUM_THREADS / 2; i++) {
+        ok[i] = true;
+        threads.push_back(thread(insertThread, lfcaTree, PARALLEL_START + i, PARALLEL_END, NUM_THREADS / 2));
+        threads.push_back(thread(rangeQueryThread, lfcaTree, PARALLEL_START, PARALLEL_END, 100, &ok[i]));
+    }
+
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads.at(i).join();
+    }
+
+    for (int i = 0; i < NUM_THREADS / 2; i++) {
+        EXPECT_TRUE(ok[i]);
+    }
+
+    // Once the inserts are done, a range query returns everything in its range
+    vector<int> expectedQuery;
+    for (int i = PARALLEL_START; i <= PARALLEL_END; i++) {
+        expectedQuery.push_back(i);
+    }
+    vector<int> actualQuery = lfcaTree->rangeQuery(PARALLEL_START, PARALLEL_END);
+    sort(actualQuery.begin(), actualQuery.end());
+    EXPECT_EQ(expectedQuery, actualQuery);
+}
+
+TEST_F(LfcaTreeTest, ParallelMvccRangeQueryAndInsert) {
+    LfcaTree mvccTree(true);
+    vector<thread> threads;
+    bool ok[NUM_THREADS / 2];
+
+    for (int i = 0; i < NUM_THREADS / 2; i++) {
+        ok[i] = true;
+        threads.push_back(thread(insertThread, &mvccTree, PARALLEL_START + i, PARALLEL_END, NUM_THREADS / 2));
+        threads.push_back(thread(rangeQueryThread, &mvccTree, PARALLEL_START, PARALLEL_END, 100, &ok[i]));
+    }
+
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads.at(i).join();
+    }
+
+    for (int i = 0; i < NUM_THREADS / 2; i++) {
+        EXPECT_TRUE(ok[i]);
+    }
+
+    vector<int> expectedQuery;
+    for (int i = PARALLEL_START; i <= PARALLEL_END; i++) {
+        expectedQuery.push_back(i);
+    }
+    vector<int> actualQuery = mvccTree.rangeQuery(PARALLEL_START, PARALLEL_END);
+    sort(actualQuery.begin(), actualQuery.end());
+    EXPECT_EQ(expectedQuery, actualQuery);
+}
+
+// Narrow range queries over keys that never change, inside the range of a wide range query
+static void coveredRangeQueryThread(LfcaTree *tree, int seed, int numQueries, bool *ok) {
+    LfcaTrace::registerThread();
+
+    for (int i = 0; i < numQueries; i++) {
+        int lo = (seed + i * 97) % (COVERED_RANGE_KEYS / 4);
+        int hi = lo + 16;
+
+        vector<int> expected;
+        for (int v = lo + lo % 2; v <= hi; v += 2) {
+            expected.push_back(v);
+        }
+
+        vector<int> result = tree->rangeQuery(lo, hi);
+        sort(result.begin(), result.end());
+        if (result != expected) {
+            *ok = false;
+        }
+    }
+}
+
+static void wideRangeQueryThread(LfcaTree *tree, atomic<bool> *stop, bool *ok) {
+    LfcaTrace::registerThread();
+
+    for (int i = 0; i < COVERED_RANGE_WIDE_QUERIES && !stop->load(); i++) {
+        vector<int> result = tree->rangeQuery(0, COVERED_RANGE_KEYS);
+        sort(result.begin(), result.end());
+
+        // Results must be in range and must not contain duplicates. The even keys are never removed
+        if (adjacent_find(result.begin(), result.end()) != result.end()) {
+            *ok = false;
+        }
+        if (!result.empty() && (result.front() < 0 || result.back() > COVERED_RANGE_KEYS)) {
+            *ok = false;
+        }
+        if (count_if(result.begin(), result.end(), [](int v) { return v % 2 == 0; }) != COVERED_RANGE_KEYS / 2) {
+            *ok = false;
+        }
+    }
+}
+
+// Toggles odd keys at the top of the range, so that updates only help the wide range queries once they are nearly done
+static void oddUpdateThread(LfcaTree *tree, int seed, int numOps) {
+    for (int i = 0; i < numOps; i++) {
+        int val = COVERED_RANGE_KEYS - 1 - 2 * ((seed + i * 31) % (COVERED_RANGE_KEYS / 16));
+        if (!tree->insert(val)) {
+            tree->remove(val);
+        }
+    }
+}
+
+TEST_F(LfcaTreeTest, ParallelCoveredRangeQueries) {
+    for (int i = 0; i < COVERED_RANGE_KEYS; i += 2) {
+        lfcaTree->insert(i);
+    }
+    lfcaTree->setTracing(true);
+
+    // Narrow range queries reuse the result of a wide range query only while it is running, so the wide range queries
+    // run until the other threads are done, and the rounds are repeated until a narrow range query reused a result
+    bool reused = false;
+    for (int round = 0; round < COVERED_RANGE_ROUNDS && !reused; round++) {
+        vector<thread> threads;
+        bool ok[3] = {true, true, true};
+        atomic<bool> stop{false};
+
+        thread wide(wideRangeQueryThread, lfcaTree, &stop, &ok[0]);
+        for (int i = 0; i < 2; i++) {
+            threads.push_back(thread(coveredRangeQueryThread, lfcaTree, round * 2 + i, COVERED_RANGE_NARROW_QUERIES, &ok[i + 1]));
+            threads.push_back(thread(oddUpdateThread, lfcaTree, round * 2 + i, COVERED_RANGE_UPDATES));
+        }
+
+        for (thread &t : threads) {
+            t.join();
+        }
+        stop.store(true);
+        wide.join();
+
+        for (int i = 0; i < 3; i++) {
+            EXPECT_TRUE(ok[i]);
+        }
+
+        stringstream trace;
+        lfcaTree->dumpTrace(trace);
+        reused = trace.str().find("\"name\":\"range_reuse\"") != string::npos;
+    }
+
+    lfcaTree->setTracing(false);
+    EXPECT_TRUE(reused);
+}
+
+static void snapshotThread(LfcaTree *tree, atomic<bool> *stop, bool *ok) {
+    while (!stop->load()) {
+        LfcaSnapshot snapshot = tree->snapshot();
+
+        // Removes go in ascending order, so the remaining negative values must be a suffix of [-numVals, -1].
+        // Inserts go in ascending order, so the non-negative values must be a prefix of [0, numVals).
+        vector<int> values;
+        while (snapshot.hasNext()) {
+            values.push_back(snapshot.next());
+        }
+
+        size_t i = 0;
+        if (i < values.size() && values[i] < 0) {
+            for (int expected = values[i]; expected < 0; expected++, i++) {
+                if (i >= values.size() || values[i] != expected) {
+                    *ok = false;
+                    return;
+                }
+            }
+        }
+        for (int expected = 0; i < values.size(); expected++, i++) {
+            if (values[i] != expected) {
+                *ok = false;
+                return;
+            }
+        }
+    }
+}
+
+TEST_F(LfcaTreeTest, ParallelSnapshotIsConsistent) {
+    int numVals = 20000;
+    for (int i = -numVals; i < 0; i++) {
+        lfcaTree->insert(i);
+    }
+
+    atomic<bool> stop{false};
+    bool ok[2] = {true, true};
+
+    vector<thread> threads;
+    threads.push_back(thread(snapshotThread, lfcaTree, &stop, &ok[0]));
+    threads.push_back(thread(snapshotThread, lfcaTree, &stop, &ok[1]));
+
+    thread inserter(insertThread, lfcaTree, 0, numVals - 1, 1);
+    thread remover(removeThread, lfcaTree, -numVals, -1, 1);
+    inserter.join();
+    remover.join();
+
+    stop.store(true);
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads.at(i).join();
+    }
+
+    EXPECT_TRUE(ok[0]);
+    EXPECT_TRUE(ok[1]);
+}
+
+// Counts the tokens with range queries and snapshots, which must see each token exactly once
+static void countThread(LfcaTree *tree, atomic<bool> *stop, atomic<bool> *ok) {
+    for (int i = 0; i < 100 && !stop->load(); i++) {
+        if (tree->rangeQuery(0, 4 * MULTI_TOKENS).size() != MULTI_TOKENS) {
+            *ok = false;
+        }
+
+        size_t count = 0;
+        LfcaSnapshot snapshot = tree->snapshot();
+        while (snapshot.hasNext()) {
+            snapshot.next();
+            count++;
+        }
+        if (count != MULTI_TOKENS) {
+            *ok = false;
+        }
+    }
+}
+
+TEST_F(LfcaTreeTest, ParallelMoveKeepsCount) {
+    atomic<bool> ok{true};
+    runTokenMoves(lfcaTree, MULTI_TOKENS, 1, NUM_THREADS - 2, MULTI_OPS_PER_THREAD, 2, [this, &ok](atomic<bool> *stop) {
+        countThread(lfcaTree, stop, &ok);
+    });
+
+    EXPECT_TRUE(ok);
+}
+
+// Runs threads that insert and remove a few values, and checks that every successful update is accounted for
+static void parallelInsertRemove(LfcaTree *tree) {
+    runCountedUpdates(tree, NUM_THREADS, 3, [tree](int seed, int *inserted, int *removed) {
+        LfcaTrace::registerThread();
+        insertRemoveThread(tree, seed, MULTI_OPS_PER_THREAD, 3, inserted, removed);
+    });
+}
+
+// Whether a tree's trace holds an event with the given name
+static bool traced(LfcaTree *tree, const string &event) {
+    stringstream trace;
+    tree->dumpTrace(trace);
+    return trace.str().find("\"name\":\"" + event + "\"") != string::npos;
+}
+
+TEST_F(LfcaTreeTest, ParallelElimination) {
+    lfcaTree->setElimination(true);
+    lfcaTree->setTracing(true);
+
+    // Updates are only eliminated when opposite updates of a value meet on a contended base node, so repeat until that happened.
+    // Every successful insert and remove must be accounted for, including the eliminated ones
+    bool eliminated = false;
+    for (int round = 0; round < CONTENTION_ROUNDS && !eliminated; round++) {
+        parallelInsertRemove(lfcaTree);
+        eliminated = traced(lfcaTree, "eliminate");
+    }
+
+    lfcaTree->setTracing(false);
+
+    // On a single core, updates are rarely preempted between reading and replacing the base node, so they hardly ever contend
+    if (thread::hardware_concurrency() > 1) {
+        EXPECT_TRUE(eliminated);
+    }
+}
+
+TEST_F(LfcaTreeTest, ParallelCombining) {
+    lfcaTree->setCombining(true);
+    lfcaTree->setTracing(true);
+
+    // Updates are only combined when threads publish while a combiner waits, so repeat until that happened.
+    // Every combined update must be applied exactly once
+    bool combined = false;
+    for (int round = 0; round < CONTENTION_ROUNDS && !combined; round++) {
+        parallelInsertRemove(lfcaTree);
+        combined = traced(lfcaTree, "combine");
+    }
+
+    lfcaTree->setTracing(false);
+    EXPECT_TRUE(combined);
+}
+
+TEST_F(LfcaTreeTest, UpdateBatch) {
+    // Spread values over several base nodes
+    for (int i = 0; i < 4 * TREAP_NODES; i++) {
+        lfcaTree->insert(2 * i);
+    }
+
+    vector<batch_update> ops;
+    for (int i = 4 * TREAP_NODES - 1; i >= 0; i--) {
+        ops.push_back({update_remove, 2 * i});
+        ops.push_back({update_insert, 2 * i + 1});
+    }
+
+    // Updates of the same value take effect in batch order
+    ops.push_back({update_insert, 0});
+    ops.push_back({update_remove, 0});
+    ops.push_back({update_remove, 0});
+
+    vector<bool> results;
+    lfcaTree->updateBatch(ops, &results);
+
+    ASSERT_EQ(ops.size(), results.size());
+    for (size_t i = 0; i < 8 * TREAP_NODES; i++) {
+        EXPECT_TRUE(results[i]);
+    }
+    EXPECT_TRUE(results[8 * TREAP_NODES]);
+    EXPECT_TRUE(results[8 * TREAP_NODES + 1]);
+    EXPECT_FALSE(results[8 * TREAP_NODES + 2]);
+
+    vector<int> values = lfcaTree->rangeQuery(0, 8 * TREAP_NODES);
+    sort(values.begin(), values.end());
+    ASSERT_EQ((size_t)4 * TREAP_NODES, values.size());
+    for (int i = 0; i < 4 * TREAP_NODES; i++) {
+        EXPECT_EQ(2 * i + 1, values[i]);
+    }
+}
+
+TEST_F(LfcaTreeTest, Batcher) {
+    future<bool> first;
+    future<bool> second;
+
+    {
+        LfcaBatcher batcher(lfcaTree, 3, chrono::hours(1));
+
+        // The batch is applied once it is full
+        first = batcher.insertAsync(1);
+        second = batcher.insertAsync(1);
+        EXPECT_EQ(2u, batcher.pending());
+        EXPECT_FALSE(lfcaTree->lookup(1));
+
+        future<bool> third = batcher.removeAsync(2);
+        EXPECT_EQ(0u, batcher.pending());
+        EXPECT_TRUE(first.get());
+        EXPECT_FALSE(second.get());
+        EXPECT_FALSE(third.get());
+
+        // The rest is applied when the batcher is destroyed
+        first = batcher.insertAsync(2);
+    }
+
+    EXPECT_TRUE(first.get());
+    EXPECT_TRUE(lfcaTree->lookup(1));
+    EXPECT_TRUE(lfcaTree->lookup(2));
+
+    // The batch is applied once its oldest update has waited long enough
+    LfcaBatcher batcher(lfcaTree, 1000, chrono::microseconds(0));
+    EXPECT_TRUE(batcher.insertAsync(3).get());
+}
+
+static void batcherThread(LfcaTree *tree, int seed, int *inserted, int *removed) {
+    mt19937 randEngine(seed);
+    uniform_int_distribution<int> valDist(0, 3);
+    LfcaBatcher batcher(tree, 16);
+    vector<future<bool>> inserts;
+    vector<future<bool>> removes;
+
+    for (int i = 0; i < MULTI_OPS_PER_THREAD; i++) {
+        int val = valDist(randEngine);
+        if (i % 2 == 0) {
+            inserts.push_back(batcher.insertAsync(val));
+        }
+        else {
+            removes.push_back(batcher.removeAsync(val));
+        }
+    }
+
+    batcher.flush();
+
+    for (future<bool> &f : inserts) {
+        *inserted += f.get() ? 1 : 0;
+    }
+    for (future<bool> &f : removes) {
+        *removed += f.get() ? 1 : 0;
+    }
+}
+
+TEST_F(LfcaTreeTest, ParallelBatcher) {
+    vector<thread> threads;
+    int inserted[NUM_THREADS] = {0};
+    int removed[NUM_THREADS] = {0};
+
+    for (int i = 0; i < NUM_THREADS; i++) {
+        threads.push_back(thread(batcherThread, lfcaTree, i, &inserted[i], &removed[i]));
+    }
+
+    int expectedSize = 0;
+    for (int i = 0; i < NUM_THREADS; i++) {
+        threads.at(i).join();
+        expectedSize += inserted[i] - removed[i];
+    }
+
+    EXPECT_EQ((size_t)expectedSize, lfcaTree->rangeQuery(0, 3).size());
+}
+
+TEST_F(LfcaTreeTest, LookupBatch) {
+    for (int i = 0; i < 16 * TREAP_NODES; i += 2) {
+        lfcaTree->insert(i);
+    }
+
+    // More values than are interleaved at once, in no particular order
+    vector<int> keys;
+    for (int i = -1; i <= 16 * TREAP_NODES; i++) {
+        keys.push_back((i * 7919) % (16 * TREAP_NODES + 2) - 1);
+    }
+
+    unique_ptr<bool[]> found(new bool[keys.size()]);
+    lfcaTree->lookupBatch(keys.data(), found.get(), keys.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+        EXPECT_EQ(lfcaTree->lookup(keys[i]), found[i]) << keys[i];
+    }
+
+    // Fewer values than are interleaved at once
+    int few[] = {2, 3};
+    lfcaTree->lookupBatch(few, found.get(), 2);
+    EXPECT_TRUE(found[0]);
+    EXPECT_FALSE(found[1]);
+
+    lfcaTree->lookupBatch(few, found.get(), 0);
+}
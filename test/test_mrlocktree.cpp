@@ -0,0 +1,261 @@
+#include <chrono>
+#include <future>
+#include <gtest/gtest.h>
+#include <limits>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "../treap.h"
+#include "../mrlocktree.h"
+#include "test_helpers.h"
+
+#define NUM_THREADS 2
+#define OVERSUBSCRIBED_THREADS 8
+#define OVERSUBSCRIBED_QUEUE_SIZE 2
+#define MULTI_OPS_PER_THREAD 1000
+#define MULTI_TOKENS 200
+#define SHARED_LOCK_TIMEOUT_S 10
+
+// These values are estimates, due to the nondeterministic nature of the parallel tests.
+#define MAX_TREAPS_NEEDED (4 * OVERSUBSCRIBED_THREADS * MULTI_OPS_PER_THREAD)
+
+class MrlockTreeTest : public ::testing::Test {
+protected:
+    MrlockTree *mrlockTree;
+
+    void SetUp() override {
+        Treap::Preallocate(MAX_TREAPS_NEEDED);
+
+        mrlockTree = new MrlockTree();
+    }
+    void TearDown() override {
+        delete mrlockTree;
+
+        Treap::Deallocate();
+    }
+};
+
+TEST_F(MrlockTreeTest, InsertReportsExisting) {
+    for (int i = 0; i < TREAP_NODES / 2; i++) {
+        EXPECT_TRUE(mrlockTree->insert(i));
+    }
+    for (int i = 0; i < TREAP_NODES / 2; i++) {
+        EXPECT_FALSE(mrlockTree->insert(i));
+    }
+    EXPECT_EQ((size_t)TREAP_NODES / 2, mrlockTree->rangeQuery(0, TREAP_NODES).size());
+}
+
+TEST_F(MrlockTreeTest, UnchangedUpdatesDoNotAllocate) {
+    for (int i = 0; i < 1000; i += 2) {
+        mrlockTree->insert(i);
+    }
+
+    int treaps = Treap::NumAllocated();
+
+    for (int i = 1; i < 1000; i += 2) {
+        EXPECT_FALSE(mrlockTree->remove(i));
+    }
+    for (int i = 0; i < 1000; i += 2) {
+        EXPECT_FALSE(mrlockTree->insert(i));
+    }
+
+    EXPECT_EQ(treaps, Treap::NumAllocated());
+}
+
+TEST_F(MrlockTreeTest, Multiset) {
+    MrlockTree multisetTree(true);
+
+    EXPECT_TRUE(multisetTree.insert(1));
+    EXPECT_TRUE(multisetTree.insert(1));
+    EXPECT_EQ((vector<int>{1, 1}), multisetTree.rangeQuery(1, 1));
+
+    EXPECT_TRUE(multisetTree.remove(1));
+    EXPECT_TRUE(multisetTree.lookup(1));
+    EXPECT_TRUE(multisetTree.remove(1));
+    EXPECT_FALSE(multisetTree.lookup(1));
+
+    for (int i = 0; i < TREAP_NODES; i++) {
+        multisetTree.insert(2);
+    }
+    EXPECT_THROW(multisetTree.insert(2), out_of_range);
+    EXPECT_TRUE(multisetTree.insert(3));
+    EXPECT_TRUE(multisetTree.insert(0));
+    EXPECT_EQ((size_t)TREAP_NODES + 2, multisetTree.rangeQuery(0, 3).size());
+
+    // Fill a base node with mostly copies of its maximum, then insert below them
+    EXPECT_TRUE(multisetTree.insert(9));
+    for (int i = 0; i < TREAP_NODES; i++) {
+        EXPECT_TRUE(multisetTree.insert(10));
+    }
+    EXPECT_TRUE(multisetTree.insert(9));
+    EXPECT_EQ((size_t)TREAP_NODES + 2, multisetTree.rangeQuery(9, 10).size());
+}
+
+TEST_F(MrlockTreeTest, MultiKeyOperations) {
+    for (int i = 0; i < 1000; i += 2) {
+        mrlockTree->insert(i);
+    }
+
+    EXPECT_FALSE(mrlockTree->insertIfAbsent(1, 0));
+    EXPECT_FALSE(mrlockTree->lookup(1));
+    EXPECT_TRUE(mrlockTree->insertIfAbsent(1001, 1003));
+    EXPECT_TRUE(mrlockTree->lookup(1001));
+    EXPECT_FALSE(mrlockTree->insertIfAbsent(1001, 1003));  // Values are not duplicated
+
+    EXPECT_TRUE(mrlockTree->move(0, 1005));
+    EXPECT_FALSE(mrlockTree->lookup(0));
+    EXPECT_TRUE(mrlockTree->lookup(1005));
+    EXPECT_FALSE(mrlockTree->move(1, 3));     // From is absent
+    EXPECT_FALSE(mrlockTree->move(2, 1005));  // To is present
+    EXPECT_TRUE(mrlockTree->lookup(2));
+
+    EXPECT_FALSE(mrlockTree->compareAndSwap(3, 5));
+    EXPECT_TRUE(mrlockTree->compareAndSwap(2, 1005));
+    EXPECT_FALSE(mrlockTree->lookup(2));
+    EXPECT_TRUE(mrlockTree->remove(1005));
+    EXPECT_FALSE(mrlockTree->remove(1005));
+
+    EXPECT_EQ(499u, mrlockTree->rangeQuery(0, 2000).size());
+}
+
+TEST_F(MrlockTreeTest, SequentialKeysKeepTreeBalanced) {
+    // Sequential keys in one stripe used to build a chain of route nodes, one per split
+    const int count = 1 << MRLOCK_STRIPE_SHIFT;
+    for (int i = 0; i < count; i++) {
+        mrlockTree->insert(i);
+    }
+
+    // At least count / TREAP_NODES base nodes, within the AVL height bound of about 1.44 * log2
+    EXPECT_LE(mrlockTree->height(), 12);
+    EXPECT_EQ((size_t)count, mrlockTree->rangeQuery(0, count).size());
+
+    for (int i = 0; i < count; i++) {
+        EXPECT_TRUE(mrlockTree->lookup(i));
+    }
+
+    // Removing the keys in order merges base nodes back together, over more than one level
+    for (int i = 0; i < count; i++) {
+        mrlockTree->remove(i);
+    }
+    EXPECT_LE(mrlockTree->height(), 4);
+    EXPECT_TRUE(mrlockTree->rangeQuery(0, count).empty());
+}
+
+TEST_F(MrlockTreeTest, SharedLocksPassEachOther) {
+    // Shared with the second reader, which is left behind if it never gets the lock
+    shared_ptr<MRLock<Bitset>> lock = make_shared<MRLock<Bitset>>(MRLOCK_STRIPES);
+    shared_ptr<promise<uint32_t>> secondLocked = make_shared<promise<uint32_t>>();
+    Bitset resources;
+    resources.Resize(MRLOCK_STRIPES);
+    resources.Set(0);
+
+    // The second reader would wait forever if it waited for the first, so it locks on another thread
+    uint32_t first = lock->Lock(resources, true);
+    future<uint32_t> second = secondLocked->get_future();
+    thread reader([lock, secondLocked, resources]() {
+        secondLocked->set_value(lock->Lock(resources, true));
+    });
+
+    if (second.wait_for(chrono::seconds(SHARED_LOCK_TIMEOUT_S)) != future_status::ready) {
+        reader.detach();
+        FAIL() << "The second shared lock waited for the first";
+    }
+    reader.join();
+    lock->Unlock(second.get());
+    lock->Unlock(first);
+
+    // A writer gets the resource once the readers are done
+    lock->Unlock(lock->Lock(resources));
+}
+
+TEST_F(MrlockTreeTest, RangeQueryAcrossStripes) {
+    const int blockSize = 1 << MRLOCK_STRIPE_SHIFT;
+
+    // Put values at both ends of blocks in more than one round of stripes, including negative blocks
+    int count = 0;
+    for (int block = -MRLOCK_STRIPES; block < 2 * MRLOCK_STRIPES; block++) {
+        mrlockTree->insert(block * blockSize);
+        mrlockTree->insert(block * blockSize + blockSize - 1);
+        count += 2;
+    }
+
+    EXPECT_EQ((size_t)count, mrlockTree->rangeQuery(numeric_limits<int>::min(), numeric_limits<int>::max()).size());
+    EXPECT_EQ(2u, mrlockTree->rangeQuery(0, blockSize - 1).size());
+    EXPECT_EQ(2u, mrlockTree->rangeQuery(blockSize - 1, blockSize).size());
+    EXPECT_EQ(2u, mrlockTree->rangeQuery(-1, 0).size());
+    EXPECT_EQ(6u, mrlockTree->rangeQuery(-blockSize, 2 * blockSize - 1).size());
+    EXPECT_EQ((size_t)2 * MRLOCK_STRIPES, mrlockTree->rangeQuery(0, MRLOCK_STRIPES * blockSize - 1).size());
+    EXPECT_EQ((size_t)2 * MRLOCK_STRIPES + 1, mrlockTree->rangeQuery(0, MRLOCK_STRIPES * blockSize).size());
+}
+
+static void parallelMoveKeepsCount(MrlockTree *tree, int spacing, int numThreads = NUM_THREADS) {
+    atomic<bool> ok{true};
+    runTokenMoves(tree, MULTI_TOKENS, spacing, numThreads, MULTI_OPS_PER_THREAD, 1, [tree, spacing, &ok](atomic<bool> *stop) {
+        for (int i = 0; i < 100 && !stop->load(); i++) {
+            if (tree->rangeQuery(0, 4 * MULTI_TOKENS * spacing).size() != MULTI_TOKENS) {
+                ok = false;
+            }
+        }
+    });
+
+    EXPECT_TRUE(ok);
+}
+
+TEST_F(MrlockTreeTest, ParallelMoveKeepsCount) {
+    parallelMoveKeepsCount(mrlockTree, 1);
+}
+
+TEST_F(MrlockTreeTest, ParallelMoveAcrossStripesKeepsCount) {
+    // Spread the values over every stripe, so that moves lock two stripes and range queries lock all of them
+    parallelMoveKeepsCount(mrlockTree, (1 << MRLOCK_STRIPE_SHIFT) / 4 + 1);
+}
+
+TEST_F(MrlockTreeTest, OversubscribedLockQueue) {
+    // More threads than queue slots must wait for a slot instead of hanging
+    MrlockTree tree(false, OVERSUBSCRIBED_QUEUE_SIZE);
+    parallelMoveKeepsCount(&tree, 1, OVERSUBSCRIBED_THREADS);
+}
+
+static void churnThread(MrlockTree *tree, int seed) {
+    mt19937 randEngine(seed);
+    uniform_int_distribution<int> valDist(0, 2 * MULTI_TOKENS);
+
+    // Only change odd values, which splits, merges and rotates around the even ones
+    for (int i = 0; i < MULTI_OPS_PER_THREAD; i++) {
+        int val = valDist(randEngine) | 1;
+        if (i % 2 == 0) {
+            tree->insert(val);
+        }
+        else {
+            tree->remove(val);
+        }
+    }
+}
+
+TEST_F(MrlockTreeTest, OptimisticLookups) {
+    mrlockTree->setOptimisticReads(true);
+    for (int i = 0; i <= 2 * MULTI_TOKENS; i += 2) {
+        mrlockTree->insert(i);
+    }
+
+    vector<thread> threads;
+    for (int i = 0; i < NUM_THREADS; i++) {
+        threads.push_back(thread(churnThread, mrlockTree, i));
+    }
+
+    bool ok = true;
+    for (int round = 0; round < 20; round++) {
+        for (int i = 0; i <= 2 * MULTI_TOKENS; i += 2) {
+            ok = ok && mrlockTree->lookup(i);
+        }
+        ok = ok && !mrlockTree->lookup(-2) && !mrlockTree->lookup(2 * MULTI_TOKENS + 2);
+    }
+
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads.at(i).join();
+    }
+
+    EXPECT_TRUE(ok);
+}
@@ -0,0 +1,124 @@
+#include <atomic>
+#include <gtest/gtest.h>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "../treap.h"
+#include "../lfca.h"
+#include "test_helpers.h"
+
+// These tests mix every kind of operation on few keys, so that threads help each other and base nodes are split and joined.
+// Build with -DLFCA_TSAN=ON to run them under ThreadSanitizer.
+
+#define STRESS_THREADS 4
+#define STRESS_OPS_PER_THREAD 4000
+#define STRESS_KEYS 256
+#define STRESS_TOKENS 64
+
+// These values are estimates, due to the nondeterministic nature of the tests
+#define STRESS_TREAPS_NEEDED (8 * STRESS_THREADS * STRESS_OPS_PER_THREAD)
+#define STRESS_NODES_NEEDED (8 * STRESS_THREADS * STRESS_OPS_PER_THREAD)
+#define STRESS_RESULT_SETS_NEEDED (STRESS_THREADS * STRESS_OPS_PER_THREAD)
+#define STRESS_MULTI_STORAGES_NEEDED (STRESS_THREADS * STRESS_OPS_PER_THREAD)
+
+class StressTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        Treap::Preallocate(STRESS_TREAPS_NEEDED);
+        node::Preallocate(STRESS_NODES_NEEDED);
+        rs::Preallocate(STRESS_RESULT_SETS_NEEDED);
+        ms::Preallocate(STRESS_MULTI_STORAGES_NEEDED);
+    }
+    void TearDown() override {
+        Treap::Deallocate();
+        node::Deallocate();
+        rs::Deallocate();
+        ms::Deallocate();
+    }
+};
+
+static void mixedThread(LfcaTree *tree, int seed, int *inserted, int *removed) {
+    mt19937 randEngine(seed);
+    uniform_int_distribution<int> valDist(0, STRESS_KEYS - 1);
+    uniform_int_distribution<int> opDist(0, 5);
+
+    for (int i = 0; i < STRESS_OPS_PER_THREAD; i++) {
+        int val = valDist(randEngine);
+
+        switch (opDist(randEngine)) {
+            case 0:
+            case 1:
+                *inserted += tree->insert(val) ? 1 : 0;
+                break;
+
+            case 2:
+            case 3:
+                *removed += tree->remove(val) ? 1 : 0;
+                break;
+
+            case 4:
+                tree->lookup(val);
+                break;
+
+            case 5: {
+                vector<int> values = tree->rangeQuery(val, val + STRESS_KEYS / 8);
+                for (int v : values) {
+                    EXPECT_TRUE(v >= val && v <= val + STRESS_KEYS / 8);
+                }
+                break;
+            }
+        }
+    }
+}
+
+static void runMixed(LfcaTree *tree) {
+    runCountedUpdates(tree, STRESS_THREADS, STRESS_KEYS, [tree](int seed, int *inserted, int *removed) {
+        mixedThread(tree, seed, inserted, removed);
+    });
+}
+
+TEST_F(StressTest, Mixed) {
+    LfcaTree tree;
+    runMixed(&tree);
+}
+
+TEST_F(StressTest, MixedMvcc) {
+    LfcaTree tree(true);
+    runMixed(&tree);
+}
+
+TEST_F(StressTest, MixedCombiningAndElimination) {
+    LfcaTree tree;
+    tree.setCombining(true);
+    tree.setElimination(true);
+    runMixed(&tree);
+}
+
+static void countThread(LfcaTree *tree, atomic<bool> *stop) {
+    int keys[STRESS_KEYS];
+    bool found[STRESS_KEYS];
+    for (int i = 0; i < STRESS_KEYS; i++) {
+        keys[i] = i;
+    }
+
+    while (!stop->load()) {
+        // Snapshots see every token exactly once, while lookups see each key at a different time
+        int count = 0;
+        LfcaSnapshot snapshot = tree->snapshot();
+        while (snapshot.hasNext()) {
+            snapshot.next();
+            count++;
+        }
+        EXPECT_EQ(STRESS_TOKENS, count);
+
+        tree->lookupBatch(keys, found, STRESS_KEYS);
+    }
+}
+
+TEST_F(StressTest, MovesWithSnapshots) {
+    LfcaTree tree;
+    runTokenMoves(&tree, STRESS_TOKENS, 1, STRESS_THREADS - 1, STRESS_OPS_PER_THREAD, 1, [&tree](atomic<bool> *stop) {
+        countThread(&tree, stop);
+    });
+}
@@ -174,6 +174,19 @@ TEST_F(TreapTest, FullSplit) {
     EXPECT_EQ(medianVal, actualSplit);
 }
 
+TEST_F(TreapTest, SplitMostlyMaximum) {
+    // Fill the treap with one small value and copies of a larger value, so that the median is the maximum
+    insertHelper(1);
+    for (int i = 1; i < TREAP_NODES; i++) {
+        insertHelper(5);
+    }
+
+    // The copies of the maximum must go to the right treap, or the split would not make any room
+    EXPECT_EQ(4, treap->split(&left, &right));
+    EXPECT_EQ(1, left->getSize());
+    EXPECT_EQ(TREAP_NODES - 1, right->getSize());
+}
+
 TEST_F(TreapTest, SplitEmpty) {
     ASSERT_EQ(treap->getSize(), 0);
 
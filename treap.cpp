@@ -538,6 +538,20 @@ bool Treap::contains(int val) {
     return foundIndex != NullNode;
 }
 
+/**
+ * Prefetches the root index and the root node, which a search reads first.
+ * Finding the root node reads the root index, so this waits for its cache line
+ */
+void Treap::prefetchRoot() {
+#if defined(__GNUC__)
+    __builtin_prefetch(&root);
+    TreapIndex rootIndex = root;
+    if (rootIndex != NullNode) {
+        __builtin_prefetch(&nodes[rootIndex]);
+    }
+#endif
+}
+
 /**
  * Returns all values between a given min and max, inclusive
  * 
@@ -552,17 +566,35 @@ bool Treap::contains(int val) {
  */
 vector<int> Treap::rangeQuery(int min, int max) {
     vector<int> values;
+    rangeQuery(min, max, &values);
+    return values;
+}
 
+/**
+ * Appends all values between a given min and max, inclusive, to a vector.
+ * Apart from growing the vector, this does not allocate.
+ *
+ * @param min
+ * The minimum value (inclusive)
+ *
+ * @param max
+ * The maximum value (inclusive)
+ *
+ * @param values
+ * The vector to append the values in the Treap between the minimum and maximum values to
+ */
+void Treap::rangeQuery(int min, int max, vector<int> *values) {
     if (root == NullNode) {
-        return values;
+        return;
     }
 
-    vector<TreapIndex> nodesToCheck;
-    nodesToCheck.push_back(root);
+    // Each node is pushed at most once, so the stack never holds more than all nodes
+    TreapIndex nodesToCheck[TREAP_NODES + 1];
+    int numNodesToCheck = 0;
+    nodesToCheck[numNodesToCheck++] = root;
 
-    while (!nodesToCheck.empty()) {
-        TreapIndex currentIndex = nodesToCheck.back();
-        nodesToCheck.pop_back();
+    while (numNodesToCheck > 0) {
+        TreapIndex currentIndex = nodesToCheck[--numNodesToCheck];
 
         int currentVal = nodes[currentIndex].val;
         int currentLeft = nodes[currentIndex].left;
@@ -570,21 +602,19 @@ vector<int> Treap::rangeQuery(int min, int max) {
 
         // Add this value if it is in range
         if (currentVal >= min && currentVal <= max) {
-            values.push_back(currentVal);
+            values->push_back(currentVal);
         }
 
         // Check values to the left if this value is not smaller than the minimum value
         if (currentVal >= min && currentLeft != NullNode) {
-            nodesToCheck.push_back(currentLeft);
+            nodesToCheck[numNodesToCheck++] = currentLeft;
         }
 
         // Check values to the right if this value is not larger than the maximum value
         if (currentVal <= max && currentRight != NullNode) {
-            nodesToCheck.push_back(currentRight);
+            nodesToCheck[numNodesToCheck++] = currentRight;
         }
     }
-
-    return values;
 }
 
 /**
@@ -597,6 +627,26 @@ int Treap::getSize() {
     return size;
 }
 
+/**
+ * Get the minimum value stored in this treap
+ *
+ * @return int
+ * The minimum value in the treap
+ */
+int Treap::getMinValue() {
+    if (size == 0) {
+        throw logic_error("Cannot get the minimum value of an empty treap");
+    }
+
+    // Find the leftmost node
+    TreapIndex tempIndex = root;
+    while (nodes[tempIndex].left != NullNode) {
+        tempIndex = nodes[tempIndex].left;
+    }
+
+    return nodes[tempIndex].val;
+}
+
 /**
  * Get the maximum value stored in this treap
  *
@@ -694,7 +744,8 @@ Treap *Treap::merge(Treap *left, Treap *right) {
 }
 
 /**
- * Splits a Treap into two treaps of (on average) equal size
+ * Splits a Treap into two treaps of (on average) equal size.
+ * All copies of the split value go to the left treap.
  * 
  * @param left
  * The location to store the left split treap
@@ -714,6 +765,11 @@ int Treap::split(Treap **left, Treap **right) {
     *right = Treap::New();
     int splitVal = getMedianVal();
 
+    // In a multiset, more than half of the values can be copies of the maximum. Split just below them, so that the right treap is not empty
+    if (splitVal == getMaxValue() && splitVal != getMinValue()) {
+        splitVal--;
+    }
+
     // Copy the current treap so it can be modified (the current treap should not be changed)
     Treap workingTreap(*this);
 
@@ -62,10 +62,13 @@ public:
     Treap *immutableRemove(int val, bool *success);
 
     bool contains(int val);
+    void prefetchRoot();
 
     vector<int> rangeQuery(int min, int max);
+    void rangeQuery(int min, int max, vector<int> *values);
 
     int getSize();
+    int getMinValue();
     int getMaxValue();
 
     static Treap *merge(Treap *left, Treap *right);